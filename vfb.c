@@ -19,15 +19,61 @@
 #include <linux/delay.h>
 #include <linux/interrupt.h>
 #include <linux/platform_device.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/nodemask.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/shmem_fs.h>
+#include <linux/file.h>
+#include <linux/fcntl.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/compat.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/iosys-map.h>
+#include <linux/console.h>
+#include <linux/spinlock.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/sizes.h>
+#include <linux/overflow.h>
+#include <linux/kfifo.h>
+#include <linux/crc32.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/xxhash.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <asm/unaligned.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+#include <linux/uaccess.h>
 
 #include <linux/fb.h>
 #include <linux/init.h>
 
+#include "vfb.h"
+
 #define VFB_DRIVER_NAME "vfb"
 #define VFB_DEVHANDLER_NAME "virtual_fb"
 #define VFB_FBDEV_NAME_DEFAULT "Virtual FB"
 #define VFB_UNIQ_LEN 64
 #define VFB_UNIQ_LEN_S "64"		// for sscanf pattern 
+#define VFB_MODE_OPTION_LEN 64
+#define VFB_CMD_LEN 256
 
     /*
      *  RAM we reserve for the frame buffer. This defines the maximum screen
@@ -46,6 +92,10 @@ static char *mode_option = NULL;
 module_param(mode_option, charp, 0);
 MODULE_PARM_DESC(mode_option, "Preferred video mode (e.g. 640x480-8@60)");
 
+static u_long cache_size = 0;
+module_param(cache_size, ulong, 0644);
+MODULE_PARM_DESC(cache_size, "Released video memory kept for new devices (in bytes, 0 = off)");
+
 static const struct fb_videomode vfb_default = {
 	.xres =		640,
 	.yres =		480,
@@ -69,6 +119,190 @@ static struct fb_fix_screeninfo vfb_fix = {
 	.accel =	FB_ACCEL_NONE,
 };
 
+    /*
+     *  Per-device configuration, handed to vfb_probe() through platform data.
+     *  Devices created without options get the module parameters above.
+     */
+
+enum vfb_alloc_mode {
+	VFB_ALLOC_VMALLOC,	/* whole buffer allocated by vfb_probe() */
+	VFB_ALLOC_LAZY,		/* pages allocated on first touch */
+	VFB_ALLOC_HUGE,		/* PMD sized compound pages */
+	VFB_ALLOC_SHMEM,	/* shmem file, reclaimable */
+	VFB_ALLOC_DMABUF,	/* imported dma-buf, see vfb_mem_import() */
+};
+
+static const char * const vfb_alloc_mode_names[] = {
+	[VFB_ALLOC_VMALLOC]	= "vmalloc",
+	[VFB_ALLOC_LAZY]	= "lazy",
+	[VFB_ALLOC_HUGE]	= "huge",
+	[VFB_ALLOC_SHMEM]	= "shmem",
+	[VFB_ALLOC_DMABUF]	= "dmabuf",
+};
+
+#define VFB_DAMAGE_RECTS	8	/* accumulated per device */
+#define VFB_DAMAGE_MAX_CLIPS	4096	/* per VFBIO_DAMAGE */
+#define VFB_COPY_HINTS		8	/* accumulated per device */
+#define VFB_RECT_IO_MAX_RECTS	4096	/* per VFBIO_READ_RECTS/VFBIO_WRITE_RECTS */
+#define VFB_RECT_IO_BOUNCE	SZ_256K
+
+#define VFB_TILE_SIZE		64	/* pixels, for VFBIO_GET_TILES */
+#define VFB_CRC_ENTRIES		128	/* per device, like DRM_CRC_ENTRIES_NR */
+#define VFB_MAX_REFRESH		1000	/* Hz, bounds the emulated vblank rate */
+
+#define VFB_FILL_CHUNK		96	/* bytes, a multiple of the pixel and store sizes */
+#define VFB_FILL_NT_BYTES	SZ_256K	/* fills from this size bypass the cache, */
+#define VFB_FILL_NT_LINE	256	/* if their lines are this long */
+
+#define VFB_HIST_SUB		8	/* linear steps per power of two */
+#define VFB_HIST_BUCKETS	(62 * VFB_HIST_SUB)	/* covers all of u64 */
+
+#define VFB_CAPTURE_MAX_SLOTS	64
+
+#define VFB_HUGE_ORDER	(PMD_SHIFT - PAGE_SHIFT)
+#define VFB_HUGE_NR	(1UL << VFB_HUGE_ORDER)
+
+struct vfb_platform_data {
+	u_long videomemorysize;
+	u_long max_videomemorysize;	/* resize limit, 0 = fixed size */
+	char mode_option[VFB_MODE_OPTION_LEN];
+	u_int stride_align;		/* line length alignment in bytes, 0 = none */
+	enum vfb_alloc_mode alloc;
+	int node;			/* NUMA node of the video memory */
+	bool dirty;			/* track pages written through mappings */
+	u_int vrr_min_hz;		/* variable refresh range, 0 = fixed */
+	u_int vrr_max_hz;
+
+	/* memory to import instead, only valid while the device is added */
+	struct file *import_memfd;
+	struct dma_buf *import_dmabuf;
+};
+
+    /*
+     *  Backing store of a device. It is replaced as a whole when the
+     *  video mode changes the required size.
+     */
+
+struct vfb_mem {
+	enum vfb_alloc_mode alloc;	/* may differ from the requested one */
+	int node;
+	unsigned long npages;
+	struct page **pages;		/* NULL entries are not backed yet (lazy) */
+	void *vaddr;			/* kernel mapping, NULL for unmapped lazy buffers */
+	struct file *shmem;		/* VFB_ALLOC_SHMEM only */
+	struct dma_buf *dmabuf;		/* VFB_ALLOC_DMABUF only */
+
+	struct list_head cache_class;	/* while in the cache */
+	struct list_head cache_lru;
+};
+
+struct vfb_events;
+struct vfb_tile_grid;
+struct vfb_ring;
+struct vfb_snaps;
+struct vfb_link;
+struct vfb_crc;
+
+struct vfb_offset {
+	u32 xoffset;
+	u32 yoffset;
+	bool ywrap;
+};
+
+struct vfb_hist {
+	u64 count;
+	u64 max;
+	u32 buckets[VFB_HIST_BUCKETS];
+};
+
+struct vfb_flip_stats {
+	u64 flips;
+	u64 missed;			/* vblanks a flip was latched late by */
+	struct vfb_hist latch;		/* pan to vblank latch, ns */
+	struct vfb_hist ack;		/* latch to VFBIO_ACK_FLIP */
+	struct vfb_hist total;		/* pan to VFBIO_ACK_FLIP */
+};
+
+struct vfb_vblank {
+	spinlock_t lock;		/* everything below, taken from the timer */
+	struct hrtimer timer;
+	bool armed;
+	unsigned int users;		/* the timer runs while there are any */
+	u64 period;			/* ns */
+	u64 base;			/* count at epoch */
+	ktime_t epoch;
+	wait_queue_head_t wait;
+
+	bool vrr;			/* period is set by the content */
+	u64 min_period;			/* ns, at the highest refresh */
+	u64 max_period;			/* at the lowest */
+	bool due;			/* new content, vblank after min_period */
+
+	struct vfb_offset front;	/* shown */
+	struct vfb_offset next;		/* latched at the next vblank */
+	bool pending;			/* next is valid, holds a user */
+
+	ktime_t next_time;		/* of the pan of next */
+	u64 next_count;			/* vblank count at that pan */
+	ktime_t front_time;		/* of the pan of front */
+	ktime_t front_latched;
+	bool front_acked;
+	struct vfb_flip_stats stats;
+};
+
+struct vfb_motion {
+	u32 width;			/* geometry the hashes are of */
+	u32 height;
+	u32 bands;
+	u64 *rows;			/* hash per line */
+	u64 *cols;			/* hash per column per band, NULL below 8 bpp */
+};
+
+struct vfb_par {
+	u32 pseudo_palette[256];
+	u_long videomemorysize;
+	u_long max_videomemorysize;
+	u_int stride_align;
+	enum vfb_alloc_mode alloc;
+	int node;
+
+	struct mutex lock;		/* protects mem, its pages[] and mapping */
+	struct vfb_mem *mem;
+	unsigned int kernel_maps;	/* users of the kernel mapping */
+	unsigned int mem_gen;		/* bumped whenever mem is replaced */
+	struct address_space *mapping;	/* of the user mappings, if any */
+	atomic_t nr_mmaps;
+
+	unsigned long *dirty;		/* pages written since collected, or NULL */
+	unsigned long dirty_npages;	/* bits in dirty */
+
+	spinlock_t damage_lock;		/* drawing may happen in any context */
+	struct vfb_rect damage[VFB_DAMAGE_RECTS];
+	unsigned int nr_damage;
+	struct vfb_copy_rect copies[VFB_COPY_HINTS];
+	unsigned int nr_copies;
+	struct vfb_motion motion;	/* of the last detection, rows NULL if none */
+
+	struct vfb_events *events;
+	struct vfb_snaps *snaps;
+	struct vfb_link *link;
+
+	struct vfb_tile_grid *tiles;	/* NULL until asked for, or after a mode change */
+	u64 tile_seq;
+
+	struct fb_info *info;
+	struct vfb_ring *ring;		/* while capturing, under the fb lock */
+	struct delayed_work capture_work;
+	struct vfb_rect capture_damage;	/* since the last frame, under damage_lock */
+	bool capture_full;		/* the whole frame changed */
+
+	struct dentry *debugfs;
+	struct vfb_crc *crc;
+	struct delayed_work crc_work;
+
+	struct vfb_vblank vblank;
+};
+
 static bool vfb_enable __initdata = 0;	/* disabled by default */
 module_param(vfb_enable, bool, 0);
 MODULE_PARM_DESC(vfb_enable, "Enable Virtual FB driver");
@@ -82,31 +316,79 @@ static int vfb_pan_display(struct fb_var_screeninfo *var,
 			   struct fb_info *info);
 static int vfb_mmap(struct fb_info *info,
 		    struct vm_area_struct *vma);
+static int vfb_open(struct fb_info *info, int user);
+static int vfb_release(struct fb_info *info, int user);
+static void vfb_destroy(struct fb_info *info);
+static int vfb_ioctl(struct fb_info *info, unsigned int cmd,
+		     unsigned long arg);
+#ifdef CONFIG_COMPAT
+static int vfb_compat_ioctl(struct fb_info *info, unsigned int cmd,
+			    unsigned long arg);
+#endif
+static ssize_t vfb_read(struct fb_info *info, char __user *buf,
+			size_t count, loff_t *ppos);
+static ssize_t vfb_write(struct fb_info *info, const char __user *buf,
+			 size_t count, loff_t *ppos);
+static void vfb_fillrect(struct fb_info *info, const struct fb_fillrect *rect);
+static void vfb_copyarea(struct fb_info *info, const struct fb_copyarea *area);
+static void vfb_imageblit(struct fb_info *info, const struct fb_image *image);
 
 static const struct fb_ops vfb_ops = {
 	.owner		= THIS_MODULE,
-	.fb_read        = fb_sys_read,
-	.fb_write       = fb_sys_write,
+	.fb_open	= vfb_open,
+	.fb_release	= vfb_release,
+	.fb_destroy	= vfb_destroy,
+	.fb_read        = vfb_read,
+	.fb_write       = vfb_write,
 	.fb_check_var	= vfb_check_var,
 	.fb_set_par		= vfb_set_par,
 	.fb_setcolreg	= vfb_setcolreg,
 	.fb_pan_display	= vfb_pan_display,
-	.fb_fillrect	= sys_fillrect,
-	.fb_copyarea	= sys_copyarea,
-	.fb_imageblit	= sys_imageblit,
+	.fb_fillrect	= vfb_fillrect,
+	.fb_copyarea	= vfb_copyarea,
+	.fb_imageblit	= vfb_imageblit,
 	.fb_mmap		= vfb_mmap,
+	.fb_ioctl	= vfb_ioctl,
+#ifdef CONFIG_COMPAT
+	.fb_compat_ioctl = vfb_compat_ioctl,
+#endif
 };
 
-static int vfb_create_device(const char* uniq);
+static void vfb_default_platform_data(struct vfb_platform_data *pdata);
+static int vfb_parse_options(char *options, struct vfb_platform_data *pdata);
+static int vfb_create_device(const char* uniq, const struct vfb_platform_data *pdata);
 static void vfb_delete_device(const char* uniq);
+static int vfb_import_device(const char* uniq, const struct vfb_platform_data *pdata);
 static void vfb_get_device_uniq(struct fb_info *fb_info, char* uniq, size_t max_len);
 static void vfb_delete_devices(void);
 
 static ssize_t vfb_show_uniq(struct device *device, struct device_attribute *attr, char *buf);
 static struct device_attribute vfb_device_attr_uniq = __ATTR(uniq, S_IRUGO, vfb_show_uniq, NULL);
+static ssize_t vfb_show_alloc(struct device *device, struct device_attribute *attr, char *buf);
+static struct device_attribute vfb_device_attr_alloc = __ATTR(alloc, S_IRUGO, vfb_show_alloc, NULL);
+static ssize_t vfb_show_node(struct device *device, struct device_attribute *attr, char *buf);
+static struct device_attribute vfb_device_attr_node = __ATTR(node, S_IRUGO, vfb_show_node, NULL);
+static ssize_t vfb_show_size(struct device *device, struct device_attribute *attr, char *buf);
+static struct device_attribute vfb_device_attr_size = __ATTR(size, S_IRUGO, vfb_show_size, NULL);
+static ssize_t vfb_show_vblank(struct device *device, struct device_attribute *attr, char *buf);
+static struct device_attribute vfb_device_attr_vblank = __ATTR(vblank, S_IRUGO, vfb_show_vblank, NULL);
+static ssize_t vfb_show_vrr(struct device *device, struct device_attribute *attr, char *buf);
+static struct device_attribute vfb_device_attr_vrr = __ATTR(vrr, S_IRUGO, vfb_show_vrr, NULL);
+
+static struct device_attribute *vfb_device_attrs[] = {
+	&vfb_device_attr_uniq,
+	&vfb_device_attr_alloc,
+	&vfb_device_attr_node,
+	&vfb_device_attr_size,
+	&vfb_device_attr_vblank,
+	&vfb_device_attr_vrr,
+	NULL
+};
 
-static int vfb_add_device_attr_uniq(struct fb_info *fb_info);
-static void vfb_cleanup_device_attr_uniq(struct fb_info *fb_info);
+static int vfb_add_device_attrs(struct fb_info *fb_info);
+static void vfb_cleanup_device_attrs(struct fb_info *fb_info);
+
+static struct dentry *vfb_debugfs_root;
 
 static DEFINE_MUTEX(vfb_device_pool_lock);
 #define VFB_DEVICE_POOL_SIZE FB_MAX
@@ -143,197 +425,1966 @@ struct file_operations vfb_devhandler_fops __attribute__((__section__(".text")))
      *  Internal routines
      */
 
-static u_long get_line_length(int xres_virtual, int bpp)
+static u_long get_line_length(int xres_virtual, int bpp, u_int stride_align)
 {
 	u_long length;
 
-	length = xres_virtual * bpp;
+	length = (u_long)xres_virtual * bpp;
 	length = (length + 31) & ~31;
 	length >>= 3;
+	if (stride_align > 1)
+		length = roundup(length, stride_align);
 	return (length);
 }
 
     /*
-     *  Setting the video mode has been split into two parts.
-     *  First part, xxxfb_check_var, must not write anything
-     *  to hardware, it should only verify and adjust var.
-     *  This means it doesn't alter par but it does use hardware
-     *  data from it to check this var.
+     *  Video memory
+     *
+     *  All of it comes from mem->node (or anywhere for NUMA_NO_NODE), with
+     *  no restriction to 32-bit addressable zones.
+     *
+     *  Every page of the buffer is tracked in mem->pages[]. In vmalloc mode
+     *  they all come from one vzalloc_node() area. In lazy mode a page is
+     *  allocated the first time it is written or mapped; holes read as zero.
+     *  Lazy buffers only get a kernel mapping (info->screen_buffer) when an
+     *  in-kernel client such as fbcon opens the device.
+     *
+     *  Huge buffers are made of PMD sized compound pages, so the fault
+     *  handler's pages get mapped with PMD entries wherever the user mapping
+     *  is suitably aligned (see transhuge_vma_suitable()). The size is
+     *  rounded up to a whole number of huge pages. If they can't be had the
+     *  buffer falls back to vmalloc mode.
+     *
+     *  Shmem buffers live in an unlinked shmem file, so idle ones can be
+     *  swapped out. User mappings go straight to the file (and its fault
+     *  handler), which can also be handed out as an fd. mem->pages[] only
+     *  exists while the buffer is pinned for a kernel mapping.
      */
 
-static int vfb_check_var(struct fb_var_screeninfo *var,
-			 struct fb_info *info)
+static unsigned long vfb_mem_npages(enum vfb_alloc_mode alloc, u_long size)
 {
-	u_long line_length;
+	unsigned long npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
 
-	/*
-	 *  FB_VMODE_CONUPDATE and FB_VMODE_SMOOTH_XPAN are equal!
-	 *  as FB_VMODE_SMOOTH_XPAN is only used internally
-	 */
+	if (alloc == VFB_ALLOC_HUGE)
+		npages = round_up(npages, VFB_HUGE_NR);
+	return npages;
+}
 
-	if (var->vmode & FB_VMODE_CONUPDATE) {
-		var->vmode |= FB_VMODE_YWRAP;
-		var->xoffset = info->var.xoffset;
-		var->yoffset = info->var.yoffset;
+static struct page *vfb_mem_alloc_page(struct vfb_mem *mem)
+{
+	return alloc_pages_node(mem->node, GFP_HIGHUSER | __GFP_ZERO, 0);
+}
+
+static void vfb_mem_free_huge(struct vfb_mem *mem)
+{
+	unsigned long i;
+
+	for (i = 0; i < mem->npages; i += VFB_HUGE_NR)
+		if (mem->pages[i])
+			put_page(mem->pages[i]);
+}
+
+static int vfb_mem_alloc_huge(struct vfb_mem *mem)
+{
+	unsigned long i, j;
+	struct page *page;
+
+	for (i = 0; i < mem->npages; i += VFB_HUGE_NR) {
+		page = alloc_pages_node(mem->node, GFP_HIGHUSER | __GFP_COMP |
+					__GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+					VFB_HUGE_ORDER);
+		if (!page) {
+			vfb_mem_free_huge(mem);
+			return -ENOMEM;
+		}
+		for (j = 0; j < VFB_HUGE_NR; j++)
+			mem->pages[i + j] = nth_page(page, j);
 	}
 
-	/*
-	 *  Some very basic checks
-	 */
-	if (!var->xres)
-		var->xres = 1;
-	if (!var->yres)
-		var->yres = 1;
-	if (var->xres > var->xres_virtual)
-		var->xres_virtual = var->xres;
-	if (var->yres > var->yres_virtual)
-		var->yres_virtual = var->yres;
-	if (var->bits_per_pixel <= 1)
-		var->bits_per_pixel = 1;
-	else if (var->bits_per_pixel <= 8)
-		var->bits_per_pixel = 8;
-	else if (var->bits_per_pixel <= 16)
-		var->bits_per_pixel = 16;
-	else if (var->bits_per_pixel <= 24)
-		var->bits_per_pixel = 24;
-	else if (var->bits_per_pixel <= 32)
-		var->bits_per_pixel = 32;
-	else
-		return -EINVAL;
+	mem->vaddr = vmap(mem->pages, mem->npages, VM_MAP, PAGE_KERNEL);
+	if (!mem->vaddr) {
+		vfb_mem_free_huge(mem);
+		return -ENOMEM;
+	}
 
-	if (var->xres_virtual < var->xoffset + var->xres)
-		var->xres_virtual = var->xoffset + var->xres;
-	if (var->yres_virtual < var->yoffset + var->yres)
-		var->yres_virtual = var->yoffset + var->yres;
+	return 0;
+}
+
+static int vfb_mem_alloc_vmalloc(struct vfb_mem *mem)
+{
+	unsigned long i;
 
 	/*
-	 *  Memory limit
+	 * For real video cards we use ioremap.
 	 */
-	line_length =
-	    get_line_length(var->xres_virtual, var->bits_per_pixel);
-	if (line_length * var->yres_virtual > videomemorysize)
+	mem->vaddr = vzalloc_node(mem->npages << PAGE_SHIFT, mem->node);
+	if (!mem->vaddr)
 		return -ENOMEM;
 
-	/*
-	 * Now that we checked it we alter var. The reason being is that the video
-	 * mode passed in might not work but slight changes to it might make it
-	 * work. This way we let the user know what is acceptable.
-	 */
-	switch (var->bits_per_pixel) {
-	case 1:
-	case 8:
-		var->red.offset = 0;
-		var->red.length = 8;
-		var->green.offset = 0;
-		var->green.length = 8;
-		var->blue.offset = 0;
-		var->blue.length = 8;
-		var->transp.offset = 0;
-		var->transp.length = 0;
-		break;
-	case 16:		/* RGBA 5551 */
-		if (var->transp.length) {
-			var->red.offset = 0;
-			var->red.length = 5;
-			var->green.offset = 5;
-			var->green.length = 5;
-			var->blue.offset = 10;
-			var->blue.length = 5;
-			var->transp.offset = 15;
-			var->transp.length = 1;
-		} else {	/* RGB 565 */
-			var->red.offset = 0;
-			var->red.length = 5;
-			var->green.offset = 5;
-			var->green.length = 6;
-			var->blue.offset = 11;
-			var->blue.length = 5;
-			var->transp.offset = 0;
-			var->transp.length = 0;
+	for (i = 0; i < mem->npages; i++)
+		mem->pages[i] = vmalloc_to_page(mem->vaddr + (i << PAGE_SHIFT));
+
+	return 0;
+}
+
+static struct vfb_mem *vfb_cache_get(enum vfb_alloc_mode alloc, int node, unsigned long npages);
+
+static int vfb_mem_alloc_shmem(struct vfb_mem *mem)
+{
+	mem->shmem = shmem_file_setup(VFB_DRIVER_NAME, mem->npages << PAGE_SHIFT,
+				      VM_NORESERVE);
+	if (IS_ERR(mem->shmem)) {
+		int ret = PTR_ERR(mem->shmem);
+
+		mem->shmem = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void vfb_mem_unpin_shmem(struct vfb_mem *mem)
+{
+	unsigned long i;
+
+	if (mem->vaddr)
+		vunmap(mem->vaddr);
+	mem->vaddr = NULL;
+
+	if (!mem->pages)
+		return;
+
+	for (i = 0; i < mem->npages; i++) {
+		if (!mem->pages[i])
+			continue;
+		/* written through the kernel mapping */
+		set_page_dirty_lock(mem->pages[i]);
+		put_page(mem->pages[i]);
+	}
+	kvfree(mem->pages);
+	mem->pages = NULL;
+}
+
+    /*
+     *  An imported memfd can be sealed against writes after the import.
+     *  Shmem checks the seals on write(), the kernel mapping and the
+     *  mappings handed to /dev/fbN users check them here.
+     */
+
+static bool vfb_shmem_sealed(struct file *shmem)
+{
+	return READ_ONCE(SHMEM_I(file_inode(shmem))->seals) &
+	       (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE);
+}
+
+static int vfb_mem_pin_shmem(struct vfb_mem *mem)
+{
+	struct address_space *mapping = mem->shmem->f_mapping;
+	struct page *page;
+	unsigned long i;
+
+	if (vfb_shmem_sealed(mem->shmem))
+		return -EPERM;
+
+	mem->pages = kvcalloc(mem->npages, sizeof(*mem->pages), GFP_KERNEL);
+	if (!mem->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < mem->npages; i++) {
+		page = shmem_read_mapping_page(mapping, i);
+		if (IS_ERR(page)) {
+			vfb_mem_unpin_shmem(mem);
+			return PTR_ERR(page);
 		}
-		break;
-	case 24:		/* RGB 888 */
-		var->red.offset = 0;
-		var->red.length = 8;
-		var->green.offset = 8;
-		var->green.length = 8;
-		var->blue.offset = 16;
-		var->blue.length = 8;
-		var->transp.offset = 0;
-		var->transp.length = 0;
-		break;
-	case 32:		/* RGBA 8888 */
-		var->red.offset = 0;
-		var->red.length = 8;
-		var->green.offset = 8;
-		var->green.length = 8;
-		var->blue.offset = 16;
-		var->blue.length = 8;
-		var->transp.offset = 24;
-		var->transp.length = 8;
-		break;
+		mem->pages[i] = page;
 	}
-	var->red.msb_right = 0;
-	var->green.msb_right = 0;
-	var->blue.msb_right = 0;
-	var->transp.msb_right = 0;
 
 	return 0;
 }
 
-/* This routine actually sets the video mode. It's in here where we
- * the hardware state info->par and fix which can be affected by the
- * change in par. For this driver it doesn't do much.
- */
-static int vfb_set_par(struct fb_info *info)
+static struct vfb_mem *vfb_mem_alloc(enum vfb_alloc_mode alloc, int node, u_long size)
 {
-	switch (info->var.bits_per_pixel) {
-	case 1:
-		info->fix.visual = FB_VISUAL_MONO01;
+	struct vfb_mem *mem;
+	int ret = 0;
+
+	mem = vfb_cache_get(alloc, node, vfb_mem_npages(alloc, size));
+	if (mem)
+		return mem;
+
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL);
+	if (!mem)
+		return NULL;
+
+	mem->alloc = alloc;
+	mem->node = node;
+	mem->npages = vfb_mem_npages(alloc, size);
+
+	if (mem->alloc == VFB_ALLOC_SHMEM) {
+		if (vfb_mem_alloc_shmem(mem))
+			goto err;
+		return mem;
+	}
+
+	mem->pages = kvcalloc(mem->npages, sizeof(*mem->pages), GFP_KERNEL);
+	if (!mem->pages)
+		goto err;
+
+	if (mem->alloc == VFB_ALLOC_HUGE) {
+		if (!vfb_mem_alloc_huge(mem))
+			return mem;
+
+		kvfree(mem->pages);
+		printk("vfb: no huge pages available, falling back to vmalloc\n");
+		mem->alloc = VFB_ALLOC_VMALLOC;
+		mem->npages = vfb_mem_npages(mem->alloc, size);
+		mem->pages = kvcalloc(mem->npages, sizeof(*mem->pages), GFP_KERNEL);
+		if (!mem->pages)
+			goto err;
+	}
+
+	if (mem->alloc == VFB_ALLOC_VMALLOC)
+		ret = vfb_mem_alloc_vmalloc(mem);
+
+	if (ret)
+		goto err1;
+
+	return mem;
+err1:
+	kvfree(mem->pages);
+err:
+	kfree(mem);
+	return NULL;
+}
+
+static void vfb_mem_free(struct vfb_mem *mem)
+{
+	unsigned long i;
+
+	/* pages still mapped by a process are freed on munmap */
+	switch (mem->alloc) {
+	case VFB_ALLOC_VMALLOC:
+		vfree(mem->vaddr);
 		break;
-	case 8:
-		info->fix.visual = FB_VISUAL_PSEUDOCOLOR;
+	case VFB_ALLOC_LAZY:
+		if (mem->vaddr)
+			vunmap(mem->vaddr);
+		for (i = 0; i < mem->npages; i++)
+			if (mem->pages[i])
+				put_page(mem->pages[i]);
 		break;
-	case 16:
-	case 24:
-	case 32:
-		info->fix.visual = FB_VISUAL_TRUECOLOR;
+	case VFB_ALLOC_HUGE:
+		vunmap(mem->vaddr);
+		vfb_mem_free_huge(mem);
 		break;
-	}
+	case VFB_ALLOC_SHMEM:
+		vfb_mem_unpin_shmem(mem);
+		fput(mem->shmem);
+		break;
+	case VFB_ALLOC_DMABUF: {
+		struct iosys_map map = IOSYS_MAP_INIT_VADDR(mem->vaddr);
 
-	info->fix.line_length = get_line_length(info->var.xres_virtual,
-						info->var.bits_per_pixel);
+		dma_buf_vunmap_unlocked(mem->dmabuf, &map);
+		dma_buf_put(mem->dmabuf);
+		break;
+	}
+	}
 
-	return 0;
+	kvfree(mem->pages);
+	kfree(mem);
 }
 
     /*
-     *  Set a single color register. The values supplied are already
-     *  rounded down to the hardware's capabilities (according to the
-     *  entries in the var structure). Return != 0 for invalid regno.
+     *  Seal an imported memfd against shrinking, the way F_ADD_SEALS
+     *  would, so that mem->npages can't go stale under the page array and
+     *  the mappings. A memfd that doesn't allow sealing has to come with
+     *  F_SEAL_SHRINK already.
      */
 
-static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
-			 u_int transp, struct fb_info *info)
+static int vfb_memfd_seal(struct file *memfd)
 {
-	if (regno >= 256)	/* no. of hw registers */
-		return 1;
-	/*
-	 * Program hardware... do anything you want with transp
-	 */
+	struct inode *inode = file_inode(memfd);
+	unsigned int *seals = &SHMEM_I(inode)->seals;
+	int ret = 0;
 
-	/* grayscale works only partially under directcolor */
-	if (info->var.grayscale) {
-		/* grayscale = 0.30*R + 0.59*G + 0.11*B */
-		red = green = blue =
-		    (red * 77 + green * 151 + blue * 28) >> 8;
-	}
+	inode_lock(inode);
+	if (*seals & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))
+		ret = -EPERM;
+	else if (!(*seals & F_SEAL_SHRINK) && (*seals & F_SEAL_SEAL))
+		ret = -EPERM;
+	else
+		*seals |= F_SEAL_SHRINK;
+	inode_unlock(inode);
 
-	/* Directcolor:
-	 *   var->{color}.offset contains start of bitfield
-	 *   var->{color}.length contains length of bitfield
-	 *   {hardwarespecific} contains width of RAMDAC
-	 *   cmap[X] is programmed to (X << red.offset) | (X << green.offset) | (X << blue.offset)
+	return ret;
+}
+
+    /*
+     *  Wrap memory handed in by a producer. A memfd is used like a shmem
+     *  buffer of our own, sealed against shrinking. A dma-buf is only
+     *  reachable through its kernel mapping (and its own mmap), it has no
+     *  page array. The size is the one of the import.
+     */
+
+static struct vfb_mem *vfb_mem_import(struct file *memfd, struct dma_buf *dmabuf,
+				      u_long *size)
+{
+	struct vfb_mem *mem;
+	int ret;
+
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL);
+	if (!mem)
+		return ERR_PTR(-ENOMEM);
+
+	mem->node = NUMA_NO_NODE;
+
+	if (memfd) {
+		mem->alloc = VFB_ALLOC_SHMEM;
+		ret = vfb_memfd_seal(memfd);
+		if (ret)
+			goto err;
+		*size = i_size_read(file_inode(memfd));
+	} else {
+		struct iosys_map map;
+
+		mem->alloc = VFB_ALLOC_DMABUF;
+		*size = dmabuf->size;
+
+		ret = dma_buf_vmap_unlocked(dmabuf, &map);
+		if (ret)
+			goto err;
+		if (map.is_iomem) {
+			dma_buf_vunmap_unlocked(dmabuf, &map);
+			ret = -EOPNOTSUPP;
+			goto err;
+		}
+		mem->vaddr = map.vaddr;
+	}
+
+	if (!*size) {
+		ret = -EINVAL;
+		goto err1;
+	}
+	mem->npages = vfb_mem_npages(mem->alloc, *size);
+
+	if (memfd) {
+		mem->shmem = get_file(memfd);
+	} else {
+		get_dma_buf(dmabuf);
+		mem->dmabuf = dmabuf;
+	}
+
+	return mem;
+err1:
+	if (mem->vaddr) {
+		struct iosys_map map = IOSYS_MAP_INIT_VADDR(mem->vaddr);
+
+		dma_buf_vunmap_unlocked(dmabuf, &map);
+	}
+err:
+	kfree(mem);
+	return ERR_PTR(ret);
+}
+
+    /*
+     *  Cache of released video memory
+     *
+     *  vmalloc and huge buffers nobody references any more are kept, up to
+     *  cache_size bytes, and handed to new devices asking for the same mode,
+     *  node and size. Entries are grouped by size class (log2 of the page
+     *  count) and cleared by a worker before they can be reused, so a hit
+     *  costs neither allocation nor zeroing. Statistics are in debugfs.
+     */
+
+#define VFB_CACHE_CLASSES	BITS_PER_LONG
+
+static DEFINE_MUTEX(vfb_cache_lock);
+static struct list_head vfb_cache_classes[VFB_CACHE_CLASSES];
+static LIST_HEAD(vfb_cache_lru);	/* cleared entries, oldest first */
+static LIST_HEAD(vfb_cache_dirty);	/* entries waiting to be cleared */
+static u_long vfb_cache_bytes;		/* of all entries, incl. the ones being cleared */
+static unsigned int vfb_cache_entries;
+static u_long vfb_cache_hits;
+static u_long vfb_cache_misses;
+static u_long vfb_cache_evictions;
+
+static void vfb_cache_clear_work_fn(struct work_struct *work);
+static DECLARE_WORK(vfb_cache_clear_work, vfb_cache_clear_work_fn);
+
+static void vfb_cache_init(void)
+{
+	for (int i = 0; i < VFB_CACHE_CLASSES; i++)
+		INIT_LIST_HEAD(&vfb_cache_classes[i]);
+}
+
+static u_long vfb_mem_bytes(struct vfb_mem *mem)
+{
+	return mem->npages << PAGE_SHIFT;
+}
+
+    /*
+     *  Only memory without outstanding references may be recycled, a page
+     *  still held by a reader or a mapping must not show up in another
+     *  device.
+     */
+
+static bool vfb_mem_reusable(struct vfb_mem *mem)
+{
+	unsigned long step = mem->alloc == VFB_ALLOC_HUGE ? VFB_HUGE_NR : 1;
+	unsigned long i;
+
+	if (mem->alloc == VFB_ALLOC_LAZY || mem->alloc == VFB_ALLOC_SHMEM ||
+	    mem->alloc == VFB_ALLOC_DMABUF)
+		return false;
+
+	for (i = 0; i < mem->npages; i += step)
+		if (page_count(mem->pages[i]) != 1)
+			return false;
+
+	return true;
+}
+
+static void vfb_cache_evict(u_long limit)
+{
+	struct vfb_mem *mem;
+
+	while (vfb_cache_bytes > limit &&
+	       (mem = list_first_entry_or_null(&vfb_cache_lru, struct vfb_mem, cache_lru))) {
+		list_del(&mem->cache_lru);
+		list_del(&mem->cache_class);
+		vfb_cache_bytes -= vfb_mem_bytes(mem);
+		vfb_cache_entries--;
+		vfb_cache_evictions++;
+		vfb_mem_free(mem);
+	}
+}
+
+static struct vfb_mem *vfb_cache_get(enum vfb_alloc_mode alloc, int node, unsigned long npages)
+{
+	struct vfb_mem *mem;
+
+	if (alloc == VFB_ALLOC_LAZY || alloc == VFB_ALLOC_SHMEM ||
+	    !READ_ONCE(cache_size))
+		return NULL;
+
+	mutex_lock(&vfb_cache_lock);
+	list_for_each_entry(mem, &vfb_cache_classes[ilog2(npages)], cache_class) {
+		if (mem->alloc == alloc && mem->npages == npages &&
+		    (node == NUMA_NO_NODE || mem->node == node)) {
+			list_del(&mem->cache_lru);
+			list_del(&mem->cache_class);
+			vfb_cache_bytes -= vfb_mem_bytes(mem);
+			vfb_cache_entries--;
+			vfb_cache_hits++;
+			mutex_unlock(&vfb_cache_lock);
+			return mem;
+		}
+	}
+	vfb_cache_misses++;
+	mutex_unlock(&vfb_cache_lock);
+
+	return NULL;
+}
+
+    /*
+     *  Give a buffer back: it goes to the cache if it fits, otherwise it
+     *  is freed.
+     */
+
+static void vfb_mem_release(struct vfb_mem *mem)
+{
+	u_long limit = READ_ONCE(cache_size);
+	u_long bytes = vfb_mem_bytes(mem);
+
+	if (bytes > limit || !vfb_mem_reusable(mem)) {
+		vfb_mem_free(mem);
+		return;
+	}
+
+	mutex_lock(&vfb_cache_lock);
+	vfb_cache_evict(limit - bytes);
+	if (vfb_cache_bytes + bytes > limit) {
+		/* the rest is still being cleared */
+		mutex_unlock(&vfb_cache_lock);
+		vfb_mem_free(mem);
+		return;
+	}
+	list_add_tail(&mem->cache_lru, &vfb_cache_dirty);
+	vfb_cache_bytes += bytes;
+	vfb_cache_entries++;
+	mutex_unlock(&vfb_cache_lock);
+
+	schedule_work(&vfb_cache_clear_work);
+}
+
+static void vfb_cache_clear_work_fn(struct work_struct *work)
+{
+	struct vfb_mem *mem;
+	unsigned long i;
+
+	for (;;) {
+		mutex_lock(&vfb_cache_lock);
+		mem = list_first_entry_or_null(&vfb_cache_dirty, struct vfb_mem, cache_lru);
+		if (mem)
+			list_del(&mem->cache_lru);
+		mutex_unlock(&vfb_cache_lock);
+
+		if (!mem)
+			break;
+
+		for (i = 0; i < mem->npages; i++) {
+			clear_highpage(mem->pages[i]);
+			cond_resched();
+		}
+
+		mutex_lock(&vfb_cache_lock);
+		list_add_tail(&mem->cache_lru, &vfb_cache_lru);
+		list_add(&mem->cache_class, &vfb_cache_classes[ilog2(mem->npages)]);
+		mutex_unlock(&vfb_cache_lock);
+	}
+}
+
+static void vfb_cache_drain(void)
+{
+	flush_work(&vfb_cache_clear_work);
+
+	mutex_lock(&vfb_cache_lock);
+	vfb_cache_evict(0);
+	mutex_unlock(&vfb_cache_lock);
+}
+
+static int vfb_cache_show(struct seq_file *m, void *unused)
+{
+	mutex_lock(&vfb_cache_lock);
+	seq_printf(m, "limit: %lu\n", READ_ONCE(cache_size));
+	seq_printf(m, "bytes: %lu\n", vfb_cache_bytes);
+	seq_printf(m, "entries: %u\n", vfb_cache_entries);
+	seq_printf(m, "hits: %lu\n", vfb_cache_hits);
+	seq_printf(m, "misses: %lu\n", vfb_cache_misses);
+	seq_printf(m, "evictions: %lu\n", vfb_cache_evictions);
+	mutex_unlock(&vfb_cache_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vfb_cache);
+
+    /*
+     *  Back the whole buffer and map it for in-kernel drawing.
+     */
+
+static int vfb_mem_map_kernel(struct vfb_mem *mem)
+{
+	unsigned long i;
+	int ret;
+
+	if (mem->vaddr)
+		return 0;
+
+	if (mem->alloc == VFB_ALLOC_SHMEM) {
+		ret = vfb_mem_pin_shmem(mem);
+		if (ret)
+			return ret;
+
+		mem->vaddr = vmap(mem->pages, mem->npages, VM_MAP, PAGE_KERNEL);
+		if (!mem->vaddr) {
+			vfb_mem_unpin_shmem(mem);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < mem->npages; i++) {
+		if (mem->pages[i])
+			continue;
+		mem->pages[i] = vfb_mem_alloc_page(mem);
+		if (!mem->pages[i])
+			return -ENOMEM;
+	}
+
+	mem->vaddr = vmap(mem->pages, mem->npages, VM_MAP, PAGE_KERNEL);
+	if (!mem->vaddr)
+		return -ENOMEM;
+
+	return 0;
+}
+
+    /*
+     *  Carry the contents over to a resized buffer. Lazy pages are simply
+     *  shared, everything else is copied.
+     */
+
+static int vfb_mem_copy(struct vfb_mem *dst, struct vfb_mem *src)
+{
+	unsigned long npages = min(dst->npages, src->npages);
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		if (!src->pages[i])
+			continue;
+
+		if (dst->alloc == VFB_ALLOC_LAZY && !dst->pages[i]) {
+			get_page(src->pages[i]);
+			dst->pages[i] = src->pages[i];
+			continue;
+		}
+
+		if (!dst->pages[i]) {
+			dst->pages[i] = vfb_mem_alloc_page(dst);
+			if (!dst->pages[i])
+				return -ENOMEM;
+		}
+		copy_highpage(dst->pages[i], src->pages[i]);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+    /*
+     *  fix.smem_len is only 32 bits wide. Larger buffers report the largest
+     *  page multiple that fits, the real size is in info->screen_size and
+     *  the size attribute in sysfs.
+     */
+
+static __u32 vfb_smem_len(u_long size)
+{
+	return min_t(u_long, size, U32_MAX & PAGE_MASK);
+}
+
+static void vfb_update_videomemory(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+
+	info->screen_buffer = par->mem->vaddr;
+	info->screen_size = par->videomemorysize;
+	info->fix.smem_start = (unsigned long) par->mem->vaddr;
+	info->fix.smem_len = vfb_smem_len(par->videomemorysize);
+}
+
+static unsigned long vfb_npages(struct vfb_par *par)
+{
+	unsigned long npages;
+
+	mutex_lock(&par->lock);
+	npages = par->mem->npages;
+	mutex_unlock(&par->lock);
+
+	return npages;
+}
+
+    /*
+     *  Return page idx of the buffer with a reference held, allocating it
+     *  when alloc is set. NULL means a hole (or out of memory with alloc).
+     *  If gen is given it receives the generation the page belongs to.
+     */
+
+static struct page *vfb_get_page(struct vfb_par *par, unsigned long idx, bool alloc,
+				 unsigned int *gen)
+{
+	struct vfb_mem *mem;
+	struct page *page = NULL;
+
+	mutex_lock(&par->lock);
+	mem = par->mem;
+	/* shmem and dma-buf memory has no (permanent) page array */
+	if (idx >= mem->npages || !mem->pages)
+		goto out;
+
+	page = mem->pages[idx];
+	if (!page && alloc) {
+		page = vfb_mem_alloc_page(mem);
+		mem->pages[idx] = page;
+	}
+	if (page)
+		get_page(page);
+	if (gen)
+		*gen = par->mem_gen;
+out:
+	mutex_unlock(&par->lock);
+
+	return page;
+}
+
+    /*
+     *  Event notification
+     *
+     *  VFBIO_GET_EVENT_FD hands out an fd that polls readable once one of
+     *  the selected events happened, read() returns a struct vfb_event for
+     *  each of them. Events of a type are coalesced: the reader gets the
+     *  sequence number and time of the latest one. Listeners hang off a
+     *  refcounted hub, so their fds outlive the device (they report EOF).
+     *  Nothing is done for devices without listeners but counting.
+     */
+
+#define VFB_EVENT_NR	(ilog2(VFB_EVENT_ALL) + 1)
+
+struct vfb_events {
+	struct kref kref;
+	spinlock_t lock;		/* events are raised in any context */
+	struct list_head listeners;
+	wait_queue_head_t wait;
+	u64 seq[VFB_EVENT_NR];
+	bool dead;			/* device gone */
+};
+
+struct vfb_listener {
+	struct list_head list;
+	struct vfb_events *hub;
+	u32 mask;
+	u32 pending;
+	struct vfb_event last[VFB_EVENT_NR];
+};
+
+static struct vfb_events *vfb_events_alloc(void)
+{
+	struct vfb_events *hub;
+
+	hub = kzalloc(sizeof(*hub), GFP_KERNEL);
+	if (!hub)
+		return NULL;
+
+	kref_init(&hub->kref);
+	spin_lock_init(&hub->lock);
+	INIT_LIST_HEAD(&hub->listeners);
+	init_waitqueue_head(&hub->wait);
+
+	return hub;
+}
+
+static void vfb_events_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct vfb_events, kref));
+}
+
+static void vfb_events_kill(struct vfb_events *hub)
+{
+	spin_lock_irq(&hub->lock);
+	hub->dead = true;
+	spin_unlock_irq(&hub->lock);
+
+	wake_up_interruptible_poll(&hub->wait, EPOLLHUP);
+	kref_put(&hub->kref, vfb_events_free);
+}
+
+static void vfb_notify(struct vfb_par *par, u32 type)
+{
+	struct vfb_events *hub = par->events;
+	struct vfb_listener *l;
+	unsigned long flags;
+	int i = ilog2(type);
+	u64 now = 0;
+
+	spin_lock_irqsave(&hub->lock, flags);
+	hub->seq[i]++;
+	list_for_each_entry(l, &hub->listeners, list) {
+		if (!(l->mask & type))
+			continue;
+		if (!now)
+			now = ktime_get_ns();
+		l->pending |= type;
+		l->last[i].type = type;
+		l->last[i].seq = hub->seq[i];
+		l->last[i].timestamp = now;
+	}
+	spin_unlock_irqrestore(&hub->lock, flags);
+
+	if (now)
+		wake_up_interruptible_poll(&hub->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static bool vfb_listener_ready(struct vfb_listener *l)
+{
+	return READ_ONCE(l->pending) || READ_ONCE(l->hub->dead);
+}
+
+static ssize_t vfb_events_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vfb_listener *l = file->private_data;
+	struct vfb_events *hub = l->hub;
+	struct vfb_event events[VFB_EVENT_NR];
+	unsigned int i, n = 0;
+	int ret;
+
+	if (count < sizeof(struct vfb_event))
+		return -EINVAL;
+
+	for (;;) {
+		spin_lock_irq(&hub->lock);
+		for (i = 0; i < VFB_EVENT_NR && (n + 1) * sizeof(*events) <= count; i++) {
+			if (l->pending & BIT(i)) {
+				events[n++] = l->last[i];
+				l->pending &= ~BIT(i);
+			}
+		}
+		spin_unlock_irq(&hub->lock);
+
+		if (n || READ_ONCE(hub->dead))
+			break;
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(hub->wait, vfb_listener_ready(l));
+		if (ret)
+			return ret;
+	}
+
+	if (copy_to_user(buf, events, n * sizeof(*events)))
+		return -EFAULT;
+
+	return n * sizeof(*events);
+}
+
+static __poll_t vfb_events_poll(struct file *file, poll_table *wait)
+{
+	struct vfb_listener *l = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &l->hub->wait, wait);
+
+	if (READ_ONCE(l->pending))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(l->hub->dead))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static void vfb_listener_free(struct vfb_listener *l)
+{
+	struct vfb_events *hub = l->hub;
+
+	spin_lock_irq(&hub->lock);
+	list_del(&l->list);
+	spin_unlock_irq(&hub->lock);
+
+	kref_put(&hub->kref, vfb_events_free);
+	kfree(l);
+}
+
+static int vfb_events_release(struct inode *inode, struct file *file)
+{
+	vfb_listener_free(file->private_data);
+	return 0;
+}
+
+static const struct file_operations vfb_events_fops = {
+	.owner		= THIS_MODULE,
+	.read		= vfb_events_read,
+	.poll		= vfb_events_poll,
+	.release	= vfb_events_release,
+	.llseek		= noop_llseek,
+};
+
+    /*
+     *  Dirty page tracking (dirty=1)
+     *
+     *  User mappings of devices with a page array are set up for write
+     *  notification, so the first write to a page after it was collected
+     *  faults into vfb_vm_page_mkwrite(), which records it. write() records
+     *  the pages it touches. VFBIO_GET_DIRTY turns the recorded pages into
+     *  rectangles, clears them and write protects them again by zapping
+     *  their PTEs, like fb_deferred_io does with page_mkclean(). A write
+     *  to a huge page maps all of it writable with a PMD, so all of it is
+     *  recorded.
+     *
+     *  The bitmap covers the largest buffer the device can get, replacing
+     *  the buffer marks it all dirty. Called with par->lock held.
+     */
+
+static void vfb_vblank_kick(struct vfb_par *par);
+
+static void vfb_set_dirty(struct vfb_par *par, unsigned long first, unsigned long nr)
+{
+	if (!par->dirty || first >= par->dirty_npages)
+		return;
+
+	bitmap_set(par->dirty, first, min(nr, par->dirty_npages - first));
+	vfb_notify(par, VFB_EVENT_DIRTY);
+	vfb_vblank_kick(par);
+}
+
+    /*
+     *  After a pan or a mode change the next captured frame is all damage.
+     *  A pan publishes it right away. See the capture ring below.
+     */
+
+static void vfb_capture_damage_all(struct vfb_par *par)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	par->capture_full = true;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+}
+
+static void vfb_capture_kick(struct vfb_par *par)
+{
+	vfb_capture_damage_all(par);
+	if (READ_ONCE(par->ring))
+		mod_delayed_work(system_wq, &par->capture_work, 0);
+}
+
+    /*
+     *  Frame CRCs, see the debugfs files further down. A pan computes one
+     *  right away.
+     */
+
+struct vfb_crc_entry {
+	u64 frame;
+	u32 crc;
+};
+
+struct vfb_crc {
+	struct kref kref;		/* the device and an open crc/data */
+	spinlock_t lock;		/* everything below */
+	bool opened;			/* CRCs are generated while crc/data is open */
+	bool overflow;
+	struct vfb_rect source;		/* within the visible frame, no width for all of it */
+	DECLARE_KFIFO(fifo, struct vfb_crc_entry, VFB_CRC_ENTRIES);
+	wait_queue_head_t wait;
+};
+
+static void vfb_crc_kick(struct vfb_par *par)
+{
+	if (READ_ONCE(par->crc->opened))
+		mod_delayed_work(system_wq, &par->crc_work, 0);
+}
+
+    /*
+     *  Emulated vblank
+     *
+     *  The counter is a function of time: vblanks are period apart from
+     *  epoch, both reset on a mode change. So it's exact without a timer,
+     *  the hrtimer only runs while someone waits for a vblank, firing at
+     *  each of them. A frame starts with the vertical blanking, lower
+     *  margin, sync and upper margin, then come the visible lines.
+     *
+     *  With variable refresh (vrr= of add) the period is the longest one
+     *  of the range, so idle heads still count at the lowest refresh
+     *  without a timer. Flips and damage bring the next vblank forward to
+     *  min_period after the last one, or now if that has passed. Such a
+     *  vblank is off the grid and becomes the new epoch.
+     */
+
+static u64 vfb_htotal(const struct fb_var_screeninfo *var)
+{
+	return (u64)var->xres + var->left_margin + var->right_margin + var->hsync_len;
+}
+
+static u64 vfb_vtotal(const struct fb_var_screeninfo *var)
+{
+	return (u64)var->yres + var->upper_margin + var->lower_margin + var->vsync_len;
+}
+
+    /*
+     *  Duration of a frame of the mode: the pixel clock in ps times the
+     *  pixels including the margins and syncs. 60 Hz without a clock, at
+     *  most VFB_MAX_REFRESH. vfb_check_var() made sure it doesn't overflow.
+     */
+
+static u64 vfb_frame_ns(const struct fb_var_screeninfo *var)
+{
+	if (!var->pixclock)
+		return NSEC_PER_SEC / 60;
+
+	return max_t(u64, div_u64(var->pixclock * vfb_htotal(var) * vfb_vtotal(var), 1000),
+		     NSEC_PER_SEC / VFB_MAX_REFRESH);
+}
+
+static u64 vfb_vblank_period(struct vfb_vblank *vb)
+{
+	return vb->vrr ? vb->max_period : vb->period;
+}
+
+static u64 vfb_vblank_count_locked(struct vfb_vblank *vb, ktime_t now, ktime_t *ts)
+{
+	u64 period = vfb_vblank_period(vb);
+	u64 n = div64_u64(ktime_to_ns(ktime_sub(now, vb->epoch)), period);
+
+	if (ts)
+		*ts = ktime_add_ns(vb->epoch, n * period);
+	return vb->base + n;
+}
+
+    /*
+     *  The number of the last vblank, and in ts its time if given.
+     */
+
+static u64 vfb_vblank_count(struct vfb_par *par, ktime_t *ts)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+	u64 count;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	count = vfb_vblank_count_locked(vb, ktime_get(), ts);
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	return count;
+}
+
+static ktime_t vfb_vblank_next_locked(struct vfb_vblank *vb)
+{
+	ktime_t now = ktime_get();
+	ktime_t ts;
+
+	vfb_vblank_count_locked(vb, now, &ts);
+	if (vb->due)
+		return max(ktime_add_ns(ts, vb->min_period), now);
+	return ktime_add_ns(ts, vfb_vblank_period(vb));
+}
+
+    /*
+     *  New content with variable refresh. A running timer is pulled in,
+     *  else the flip that takes a user starts it at the right time. Damage
+     *  nobody waits for doesn't start it.
+     */
+
+static void vfb_vblank_kick_locked(struct vfb_vblank *vb)
+{
+	if (!vb->vrr || vb->due)
+		return;
+
+	vb->due = true;
+	if (vb->armed && vb->users)
+		hrtimer_start(&vb->timer, vfb_vblank_next_locked(vb), HRTIMER_MODE_ABS);
+}
+
+static void vfb_vblank_kick(struct vfb_par *par)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+
+	if (!vb->vrr)
+		return;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	vfb_vblank_kick_locked(vb);
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+    /*
+     *  Latency histograms: exact below VFB_HIST_SUB, above that each power
+     *  of two is split into VFB_HIST_SUB linear steps, so percentiles are
+     *  off by less than 1/VFB_HIST_SUB.
+     */
+
+static unsigned int vfb_hist_bucket(u64 v)
+{
+	unsigned int msb;
+
+	if (v < VFB_HIST_SUB)
+		return v;
+
+	msb = fls64(v) - 1;
+	return (msb - 2) * VFB_HIST_SUB + ((v >> (msb - 3)) & (VFB_HIST_SUB - 1));
+}
+
+static u64 vfb_hist_upper(unsigned int b)
+{
+	unsigned int msb = b / VFB_HIST_SUB + 2;
+
+	if (b < VFB_HIST_SUB)
+		return b;
+
+	/* the last value of the bucket */
+	return ((u64)(VFB_HIST_SUB + b % VFB_HIST_SUB + 1) << (msb - 3)) - 1;
+}
+
+static void vfb_hist_add(struct vfb_hist *h, u64 v)
+{
+	h->buckets[vfb_hist_bucket(v)]++;
+	h->count++;
+	h->max = max(h->max, v);
+}
+
+static u64 vfb_hist_percentile(const struct vfb_hist *h, unsigned int pct)
+{
+	u64 rank = div_u64(h->count * pct + 99, 100);
+	u64 seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < VFB_HIST_BUCKETS && rank; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank)
+			return min(vfb_hist_upper(b), h->max);
+	}
+	return 0;
+}
+
+static void vfb_flip_latched(struct vfb_vblank *vb, ktime_t submitted, ktime_t now)
+{
+	vb->stats.flips++;
+	vfb_hist_add(&vb->stats.latch, ktime_to_ns(ktime_sub(now, submitted)));
+	vb->front_time = submitted;
+	vb->front_latched = now;
+	vb->front_acked = false;
+}
+
+static enum hrtimer_restart vfb_vblank_timer(struct hrtimer *timer)
+{
+	struct vfb_vblank *vb = container_of(timer, struct vfb_vblank, timer);
+	struct vfb_par *par = container_of(vb, struct vfb_par, vblank);
+	unsigned long flags;
+	bool flipped = false;
+	ktime_t now;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	now = ktime_get();
+
+	/* pulled in by vfb_vblank_kick_locked() while we waited for the lock */
+	if (ktime_after(hrtimer_get_expires(timer), now)) {
+		spin_unlock_irqrestore(&vb->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	if (vb->vrr) {
+		ktime_t t = hrtimer_get_expires(timer);
+		ktime_t ts;
+
+		vb->base = vfb_vblank_count_locked(vb, t, &ts);
+		if (ts != t)
+			vb->base++;
+		vb->epoch = t;
+		vb->due = false;
+	}
+
+	if (vb->pending) {
+		u64 count = vfb_vblank_count_locked(vb, now, NULL);
+
+		vb->front = vb->next;
+		vb->pending = false;
+		vb->users--;
+		vfb_flip_latched(vb, vb->next_time, now);
+		if (count > vb->next_count + 1)
+			vb->stats.missed += count - vb->next_count - 1;
+		flipped = true;
+	}
+	/*
+	 * Restarted rather than HRTIMER_RESTART, as vfb_vblank_kick_locked()
+	 * may restart it from another CPU.
+	 */
+	if (vb->users)
+		hrtimer_start(timer, vfb_vblank_next_locked(vb), HRTIMER_MODE_ABS);
+	else
+		vb->armed = false;
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	if (flipped) {
+		vfb_notify(par, VFB_EVENT_FLIP);
+		vfb_capture_kick(par);
+		vfb_crc_kick(par);
+	}
+	wake_up_all(&vb->wait);
+	return HRTIMER_NORESTART;
+}
+
+static void vfb_vblank_init(struct vfb_par *par, u_int min_hz, u_int max_hz)
+{
+	struct vfb_vblank *vb = &par->vblank;
+
+	spin_lock_init(&vb->lock);
+	hrtimer_init(&vb->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vb->timer.function = vfb_vblank_timer;
+	vb->period = NSEC_PER_SEC / 60;
+	vb->epoch = ktime_get();
+	init_waitqueue_head(&vb->wait);
+
+	if (min_hz && max_hz) {
+		vb->vrr = true;
+		vb->min_period = NSEC_PER_SEC / max_hz;
+		vb->max_period = NSEC_PER_SEC / min_hz;
+	}
+}
+
+    /*
+     *  Called on mode changes. The count carries on from where it was.
+     */
+
+static void vfb_vblank_set_period(struct vfb_par *par, u64 period)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&vb->lock, flags);
+	vb->base = vfb_vblank_count_locked(vb, now, NULL);
+	vb->epoch = now;
+	vb->period = period;
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+static void vfb_vblank_get_locked(struct vfb_vblank *vb)
+{
+	if (!vb->users++ && !vb->armed) {
+		vb->armed = true;
+		hrtimer_start(&vb->timer, vfb_vblank_next_locked(vb), HRTIMER_MODE_ABS);
+	}
+}
+
+static void vfb_vblank_get(struct vfb_par *par)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	vfb_vblank_get_locked(vb);
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+static void vfb_vblank_put(struct vfb_par *par)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+
+	/* the timer stops itself at the next vblank */
+	spin_lock_irqsave(&vb->lock, flags);
+	vb->users--;
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+    /*
+     *  Page flipping
+     *
+     *  A pan with FB_ACTIVATE_VBL is queued and returns right away, the
+     *  vblank timer latches it into the front buffer and sends
+     *  VFB_EVENT_FLIP. Another one while it's pending gets -EBUSY. Wait
+     *  for it with FBIO_WAITFORVSYNC or the event fd. Other pans, like
+     *  those of the console, take effect at once and replace a pending
+     *  flip, as fbcon ignores errors. Consumers inside the driver
+     *  (capture, CRCs, snapshots) show the front buffer, while info->var
+     *  has the offsets of the last pan.
+     */
+
+static void vfb_front(struct vfb_par *par, struct fb_var_screeninfo *var)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	var->xoffset = vb->front.xoffset;
+	var->yoffset = vb->front.yoffset;
+	if (vb->front.ywrap)
+		var->vmode |= FB_VMODE_YWRAP;
+	else
+		var->vmode &= ~FB_VMODE_YWRAP;
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+    /*
+     *  Show offset at the next vblank if vbl, else now. Returns 1 if it is
+     *  shown already, 0 if queued.
+     */
+
+static int vfb_flip(struct vfb_par *par, const struct vfb_offset *offset, bool vbl)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	if (vb->pending && vbl) {
+		ret = -EBUSY;
+	} else if (vbl) {
+		vb->next = *offset;
+		vb->pending = true;
+		vb->next_time = ktime_get();
+		vb->next_count = vfb_vblank_count_locked(vb, vb->next_time, NULL);
+		vfb_vblank_kick_locked(vb);
+		vfb_vblank_get_locked(vb);
+	} else {
+		/* the console keeps scrolling over a queued flip */
+		if (vb->pending) {
+			vb->pending = false;
+			vb->users--;
+		}
+		vb->front = *offset;
+		vb->front_time = ktime_get();
+		vb->front_latched = vb->front_time;
+		vb->front_acked = false;
+		vfb_vblank_kick_locked(vb);
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	return ret;
+}
+
+    /*
+     *  A consumer picked up the front buffer, VFBIO_ACK_FLIP.
+     */
+
+static int vfb_flip_ack(struct vfb_par *par)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	if (vb->front_acked || !vb->front_latched) {
+		ret = -EALREADY;
+	} else {
+		vb->front_acked = true;
+		vfb_hist_add(&vb->stats.ack, ktime_to_ns(ktime_sub(now, vb->front_latched)));
+		vfb_hist_add(&vb->stats.total, ktime_to_ns(ktime_sub(now, vb->front_time)));
+	}
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	return ret;
+}
+
+    /*
+     *  On mode changes, which reset the offsets. A pending flip is dropped.
+     */
+
+static void vfb_flip_reset(struct vfb_par *par, const struct fb_var_screeninfo *var)
+{
+	struct vfb_vblank *vb = &par->vblank;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	if (vb->pending) {
+		vb->pending = false;
+		vb->users--;
+	}
+	vb->front.xoffset = var->xoffset;
+	vb->front.yoffset = var->yoffset;
+	vb->front.ywrap = var->vmode & FB_VMODE_YWRAP;
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+    /*
+     *  Snapshots (VFBIO_SNAPSHOT)
+     *
+     *  A snapshot holds references to the buffer pages of the visible
+     *  frame and write protects their user mappings. Whoever writes such a
+     *  page first copies it for the snapshots still sharing it: the fault
+     *  handler, write() and the drawing ops, see vfb_snap_break(). Pages
+     *  nobody writes stay shared. The buffer keeps its pages, so kernel
+     *  and exported mappings don't change, but writes through an exported
+     *  dma-buf are not seen. NULL entries weren't backed yet and read as
+     *  zeros. Like the events, snapshots hang off a refcounted hub and
+     *  outlive the device. Buffer pages only, shmem and imported buffers
+     *  aren't supported.
+     */
+
+struct vfb_snaps {
+	struct kref kref;
+	spinlock_t lock;		/* the list and the pages of all snapshots */
+	struct list_head list;
+};
+
+struct vfb_snap {
+	struct list_head list;
+	struct vfb_snaps *hub;
+	u64 start;			/* buffer offset of the first byte */
+	u64 size;
+	u64 wrap;			/* buffer size the frame wraps at, FB_VMODE_YWRAP */
+	unsigned long first;		/* buffer page of pages[0] */
+	unsigned long npages;
+	unsigned long *copied;		/* pages no longer shared with the buffer */
+	bool torn;			/* a copy failed, reads return -EIO */
+	struct page *pages[];
+};
+
+static struct vfb_snaps *vfb_snaps_alloc(void)
+{
+	struct vfb_snaps *hub;
+
+	hub = kzalloc(sizeof(*hub), GFP_KERNEL);
+	if (!hub)
+		return NULL;
+
+	kref_init(&hub->kref);
+	spin_lock_init(&hub->lock);
+	INIT_LIST_HEAD(&hub->list);
+	return hub;
+}
+
+static void vfb_snaps_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct vfb_snaps, kref));
+}
+
+    /*
+     *  Copy the pages [first, first + nr) of the buffer for the snapshots
+     *  still sharing them, before they get written. Callers that can sleep
+     *  pass GFP_KERNEL, the drawing ops GFP_ATOMIC, a snapshot that can't
+     *  get its copy is marked torn.
+     */
+
+static void vfb_snap_break(struct vfb_snaps *hub, unsigned long first,
+			   unsigned long nr, gfp_t gfp)
+{
+	unsigned long i, end, flags;
+	struct vfb_snap *snap;
+	struct page *spare = NULL;
+	struct page **page;
+	bool retry;
+
+	if (list_empty_careful(&hub->list))
+		return;
+
+	do {
+		retry = false;
+		spin_lock_irqsave(&hub->lock, flags);
+		list_for_each_entry(snap, &hub->list, list) {
+			end = min(first + nr, snap->first + snap->npages);
+			for (i = max(first, snap->first); i < end; i++) {
+				if (test_bit(i - snap->first, snap->copied))
+					continue;
+
+				page = &snap->pages[i - snap->first];
+				if (*page) {
+					/* sleeping callers allocate outside the lock */
+					if (!spare && gfpflags_allow_blocking(gfp)) {
+						retry = true;
+						goto unlock;
+					}
+					if (!spare)
+						spare = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+					if (!spare) {
+						snap->torn = true;
+					} else {
+						copy_highpage(spare, *page);
+						put_page(*page);
+						*page = spare;
+						spare = NULL;
+					}
+				}
+				__set_bit(i - snap->first, snap->copied);
+			}
+		}
+unlock:
+		spin_unlock_irqrestore(&hub->lock, flags);
+
+		if (retry) {
+			spare = alloc_page(gfp);
+			if (!spare)
+				gfp = GFP_ATOMIC;	/* last resort, then torn */
+		}
+	} while (retry);
+
+	if (spare)
+		__free_page(spare);
+}
+
+    /*
+     *  info->screen_buffer for in-kernel drawing and hashing, until the
+     *  matching vfb_unmap_kernel(). When the last user is gone a shmem
+     *  buffer is unpinned, so it can be swapped out again. Other buffers
+     *  keep their mapping, their pages stay anyway.
+     */
+
+static int vfb_map_kernel(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+	int ret;
+
+	mutex_lock(&par->lock);
+	ret = vfb_mem_map_kernel(par->mem);
+	if (!ret) {
+		info->screen_buffer = par->mem->vaddr;
+		par->kernel_maps++;
+	}
+	mutex_unlock(&par->lock);
+
+	return ret;
+}
+
+static void vfb_unmap_kernel(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+
+	mutex_lock(&par->lock);
+	if (!--par->kernel_maps && par->mem->alloc == VFB_ALLOC_SHMEM) {
+		vfb_mem_unpin_shmem(par->mem);
+		info->screen_buffer = NULL;
+	}
+	mutex_unlock(&par->lock);
+}
+
+    /*
+     *  Shmem buffers are resized in place, so the file handed out by
+     *  VFBIO_GET_MEMFD and all mappings of it stay valid. Truncation takes
+     *  care of mappings past the new end.
+     */
+
+static int vfb_resize_shmem(struct fb_info *info, u_long size)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_mem *mem = par->mem;
+	unsigned long npages = vfb_mem_npages(VFB_ALLOC_SHMEM, size);
+	bool mapped;
+	int ret, err;
+
+	mutex_lock(&par->lock);
+	mapped = mem->vaddr != NULL;
+	vfb_mem_unpin_shmem(mem);
+
+	ret = vfs_truncate(&mem->shmem->f_path, (loff_t)npages << PAGE_SHIFT);
+	if (!ret)
+		mem->npages = npages;
+
+	if (mapped) {
+		err = vfb_mem_map_kernel(mem);
+		if (!ret)
+			ret = err;
+	}
+	mutex_unlock(&par->lock);
+
+	if (!ret)
+		par->videomemorysize = size;
+	vfb_update_videomemory(info);
+
+	return ret;
+}
+
+    /*
+     *  Switch to the prepared buffer mem of the given size. Called with
+     *  par->lock held, which is dropped. The caller holds the fb lock, so
+     *  nothing else swaps par->mem meanwhile.
+     *
+     *  User mappings are zapped afterwards and refault into the new buffer.
+     *  A fault that already picked a page of the old buffer holds its page
+     *  lock until the PTE is installed and rechecks mem_gen under it, so
+     *  locking every old page once before the zap flushes those out.
+     *  Mappings that went to a shmem file or dma-buf keep the old memory.
+     */
+
+static void vfb_replace_videomemory(struct fb_info *info, struct vfb_mem *mem,
+				    u_long size)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_mem *old = par->mem;
+	unsigned long i;
+
+	par->mem = mem;
+	par->mem_gen++;
+	vfb_set_dirty(par, 0, mem->npages);
+	mutex_unlock(&par->lock);
+
+	for (i = 0; old->pages && i < old->npages; i++) {
+		if (!old->pages[i])
+			continue;
+		lock_page(old->pages[i]);
+		unlock_page(old->pages[i]);
+	}
+
+	mutex_lock(&par->lock);
+	if (par->mapping)
+		unmap_mapping_range(par->mapping, 0, 0, 1);
+	mutex_unlock(&par->lock);
+
+	par->videomemorysize = size;
+	vfb_update_videomemory(info);
+
+	/* old may be cached and handed to another device */
+	vfb_snap_break(par->snaps, 0, ULONG_MAX, GFP_KERNEL);
+	vfb_mem_release(old);
+}
+
+    /*
+     *  Replace the backing store with one of the given size, keeping the
+     *  contents.
+     */
+
+static int vfb_resize_videomemory(struct fb_info *info, u_long size)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_mem *old = par->mem;
+	struct vfb_mem *mem;
+	int ret;
+
+	/* old->alloc, which is vmalloc if huge pages weren't available */
+	if (old->npages == vfb_mem_npages(old->alloc, size)) {
+		par->videomemorysize = size;
+		info->screen_size = size;
+		info->fix.smem_len = vfb_smem_len(size);
+		return 0;
+	}
+
+	if (old->alloc == VFB_ALLOC_SHMEM)
+		return vfb_resize_shmem(info, size);
+
+	mem = vfb_mem_alloc(par->alloc, par->node, size);
+	if (!mem)
+		return -ENOMEM;
+
+	mutex_lock(&par->lock);
+	ret = old->vaddr ? vfb_mem_map_kernel(mem) : 0;
+	if (!ret)
+		ret = vfb_mem_copy(mem, old);
+	if (ret) {
+		mutex_unlock(&par->lock);
+		vfb_mem_free(mem);
+		return ret;
+	}
+	vfb_replace_videomemory(info, mem, size);
+
+	fb_info(info, "Resized to %luK of %s video memory\n",
+		size >> 10, vfb_alloc_mode_names[mem->alloc]);
+	return 0;
+}
+
+    /*
+     *  Re-point a device at imported memory, which must hold the current
+     *  mode. The contents are not carried over, the producer renders into
+     *  the new memory. The device keeps the size of the import from now on.
+     */
+
+static int vfb_import_videomemory(struct fb_info *info, struct file *memfd,
+				  struct dma_buf *dmabuf)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_mem *mem;
+	u_long size;
+	int ret;
+
+	mem = vfb_mem_import(memfd, dmabuf, &size);
+	if (IS_ERR(mem))
+		return PTR_ERR(mem);
+
+	if ((u64)info->fix.line_length * info->var.yres_virtual > size) {
+		ret = -ENOSPC;
+		goto err;
+	}
+
+	mutex_lock(&par->lock);
+	ret = par->mem->vaddr ? vfb_mem_map_kernel(mem) : 0;
+	if (ret) {
+		mutex_unlock(&par->lock);
+		goto err;
+	}
+	par->max_videomemorysize = 0;
+	vfb_replace_videomemory(info, mem, size);
+
+	fb_info(info, "Imported %luK of %s video memory\n",
+		size >> 10, vfb_alloc_mode_names[mem->alloc]);
+	return 0;
+err:
+	vfb_mem_free(mem);
+	return ret;
+}
+
+    /*
+     *  Tile hashes
+     *
+     *  VFBIO_GET_TILES hashes the virtual screen in VFB_TILE_SIZE square
+     *  tiles and reports the ones whose hash changed after the caller's
+     *  sequence number. Every call that sees a change bumps the sequence
+     *  number and stamps the changed tiles with it, so any number of
+     *  consumers can share the grid. xxh64 is used, chained over the lines
+     *  of a tile; it runs at memory speed without the FPU. The grid is
+     *  rebuilt, with all tiles changed, after a mode change. Runs under
+     *  the fb lock, like mode changes and buffer replacements.
+     */
+
+struct vfb_tile_grid {
+	u32 cols;
+	u32 rows;
+	u64 *hash;
+	u64 *changed;			/* tile_seq when the hash last changed */
+};
+
+static void vfb_motion_free(struct vfb_motion *m)
+{
+	kvfree(m->rows);
+	kvfree(m->cols);
+	m->rows = NULL;
+	m->cols = NULL;
+}
+
+static void vfb_tiles_reset(struct vfb_par *par)
+{
+	if (!par->tiles)
+		return;
+
+	kvfree(par->tiles->hash);
+	kvfree(par->tiles->changed);
+	kfree(par->tiles);
+	par->tiles = NULL;
+}
+
+static u64 vfb_tile_hash(struct fb_info *info, u32 col, u32 row)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 x = col * VFB_TILE_SIZE;
+	u32 y = row * VFB_TILE_SIZE;
+	u32 w = min_t(u32, VFB_TILE_SIZE, info->var.xres_virtual - x);
+	u32 h = min_t(u32, VFB_TILE_SIZE, info->var.yres_virtual - y);
+	size_t first = (size_t)x * bpp / 8;
+	size_t len = DIV_ROUND_UP((size_t)(x + w) * bpp, 8) - first;
+	const u8 *p = (const u8 *)info->screen_buffer + (size_t)y * info->fix.line_length + first;
+	u64 hash = 0;
+
+	for (; h; h--, p += info->fix.line_length)
+		hash = xxh64(p, len, hash);
+
+	return hash;
+}
+
+static int vfb_tiles_update(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_tile_grid *grid = par->tiles;
+	bool fresh = !grid;
+	bool changed = false;
+	u32 col, row;
+	size_t i, n;
+	u64 hash;
+
+	if (fresh) {
+		grid = kzalloc(sizeof(*grid), GFP_KERNEL);
+		if (!grid)
+			return -ENOMEM;
+
+		grid->cols = DIV_ROUND_UP(info->var.xres_virtual, VFB_TILE_SIZE);
+		grid->rows = DIV_ROUND_UP(info->var.yres_virtual, VFB_TILE_SIZE);
+		n = (size_t)grid->cols * grid->rows;
+		grid->hash = kvmalloc_array(n, sizeof(*grid->hash), GFP_KERNEL);
+		grid->changed = kvmalloc_array(n, sizeof(*grid->changed), GFP_KERNEL);
+		par->tiles = grid;
+		if (!grid->hash || !grid->changed) {
+			vfb_tiles_reset(par);
+			return -ENOMEM;
+		}
+	}
+
+	for (row = 0, i = 0; row < grid->rows; row++) {
+		for (col = 0; col < grid->cols; col++, i++) {
+			hash = vfb_tile_hash(info, col, row);
+			if (!fresh && hash == grid->hash[i])
+				continue;
+
+			grid->hash[i] = hash;
+			grid->changed[i] = par->tile_seq + 1;
+			changed = true;
+		}
+		cond_resched();
+	}
+
+	if (changed)
+		par->tile_seq++;
+
+	return 0;
+}
+
+    /*
+     *  Setting the video mode has been split into two parts.
+     *  First part, xxxfb_check_var, must not write anything
+     *  to hardware, it should only verify and adjust var.
+     *  This means it doesn't alter par but it does use hardware
+     *  data from it to check this var.
+     */
+
+static int vfb_check_var(struct fb_var_screeninfo *var,
+			 struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+	u_long line_length;
+	u64 frame;
+
+	/*
+	 *  FB_VMODE_CONUPDATE and FB_VMODE_SMOOTH_XPAN are equal!
+	 *  as FB_VMODE_SMOOTH_XPAN is only used internally
+	 */
+
+	if (var->vmode & FB_VMODE_CONUPDATE) {
+		var->vmode |= FB_VMODE_YWRAP;
+		var->xoffset = info->var.xoffset;
+		var->yoffset = info->var.yoffset;
+	}
+
+	/*
+	 *  Some very basic checks
+	 */
+	if (!var->xres)
+		var->xres = 1;
+	if (!var->yres)
+		var->yres = 1;
+	if (var->xres > var->xres_virtual)
+		var->xres_virtual = var->xres;
+	if (var->yres > var->yres_virtual)
+		var->yres_virtual = var->yres;
+	if (var->bits_per_pixel <= 1)
+		var->bits_per_pixel = 1;
+	else if (var->bits_per_pixel <= 8)
+		var->bits_per_pixel = 8;
+	else if (var->bits_per_pixel <= 16)
+		var->bits_per_pixel = 16;
+	else if (var->bits_per_pixel <= 24)
+		var->bits_per_pixel = 24;
+	else if (var->bits_per_pixel <= 32)
+		var->bits_per_pixel = 32;
+	else
+		return -EINVAL;
+
+	if (var->xres_virtual < var->xoffset + var->xres)
+		var->xres_virtual = var->xoffset + var->xres;
+	if (var->yres_virtual < var->yoffset + var->yres)
+		var->yres_virtual = var->yoffset + var->yres;
+
+	/* the frame takes pixclock * htotal * vtotal ps, see vfb_frame_ns() */
+	if (check_mul_overflow((u64)var->pixclock, vfb_htotal(var), &frame) ||
+	    check_mul_overflow(frame, vfb_vtotal(var), &frame))
+		return -EINVAL;
+
+	/*
+	 *  Memory limit
+	 */
+	line_length = get_line_length(var->xres_virtual, var->bits_per_pixel,
+				      par->stride_align);
+	if (line_length > U32_MAX)
+		return -EINVAL;
+	if ((u64)line_length * var->yres_virtual >
+	    max(par->videomemorysize, par->max_videomemorysize))
+		return -ENOMEM;
+
+	/*
+	 * Now that we checked it we alter var. The reason being is that the video
+	 * mode passed in might not work but slight changes to it might make it
+	 * work. This way we let the user know what is acceptable.
+	 */
+	switch (var->bits_per_pixel) {
+	case 1:
+	case 8:
+		var->red.offset = 0;
+		var->red.length = 8;
+		var->green.offset = 0;
+		var->green.length = 8;
+		var->blue.offset = 0;
+		var->blue.length = 8;
+		var->transp.offset = 0;
+		var->transp.length = 0;
+		break;
+	case 16:		/* RGBA 5551 */
+		if (var->transp.length) {
+			var->red.offset = 0;
+			var->red.length = 5;
+			var->green.offset = 5;
+			var->green.length = 5;
+			var->blue.offset = 10;
+			var->blue.length = 5;
+			var->transp.offset = 15;
+			var->transp.length = 1;
+		} else {	/* RGB 565 */
+			var->red.offset = 0;
+			var->red.length = 5;
+			var->green.offset = 5;
+			var->green.length = 6;
+			var->blue.offset = 11;
+			var->blue.length = 5;
+			var->transp.offset = 0;
+			var->transp.length = 0;
+		}
+		break;
+	case 24:		/* RGB 888 */
+		var->red.offset = 0;
+		var->red.length = 8;
+		var->green.offset = 8;
+		var->green.length = 8;
+		var->blue.offset = 16;
+		var->blue.length = 8;
+		var->transp.offset = 0;
+		var->transp.length = 0;
+		break;
+	case 32:		/* RGBA 8888 */
+		var->red.offset = 0;
+		var->red.length = 8;
+		var->green.offset = 8;
+		var->green.length = 8;
+		var->blue.offset = 16;
+		var->blue.length = 8;
+		var->transp.offset = 24;
+		var->transp.length = 8;
+		break;
+	}
+	var->red.msb_right = 0;
+	var->green.msb_right = 0;
+	var->blue.msb_right = 0;
+	var->transp.msb_right = 0;
+
+	return 0;
+}
+
+/* This routine actually sets the video mode. It's in here where we
+ * the hardware state info->par and fix which can be affected by the
+ * change in par. For this driver it doesn't do much, apart from resizing
+ * the video memory of devices that have a max_size.
+ */
+static int vfb_set_par(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+	u_long line_length;
+	int ret;
+
+	line_length = get_line_length(info->var.xres_virtual,
+				      info->var.bits_per_pixel,
+				      par->stride_align);
+
+	if (par->max_videomemorysize) {
+		/* fits in u_long, vfb_check_var() made sure of that */
+		ret = vfb_resize_videomemory(info, (u64)line_length * info->var.yres_virtual);
+		if (ret)
+			return ret;
+	}
+
+	switch (info->var.bits_per_pixel) {
+	case 1:
+		info->fix.visual = FB_VISUAL_MONO01;
+		break;
+	case 8:
+		info->fix.visual = FB_VISUAL_PSEUDOCOLOR;
+		break;
+	case 16:
+	case 24:
+	case 32:
+		info->fix.visual = FB_VISUAL_TRUECOLOR;
+		break;
+	}
+
+	info->fix.line_length = line_length;
+
+	/* new geometry, rebuilt on the next VFBIO_GET_TILES or detection */
+	vfb_tiles_reset(par);
+	vfb_motion_free(&par->motion);
+	vfb_capture_damage_all(par);
+	vfb_vblank_set_period(par, vfb_frame_ns(&info->var));
+	vfb_flip_reset(par, &info->var);
+
+	return 0;
+}
+
+    /*
+     *  Set a single color register. The values supplied are already
+     *  rounded down to the hardware's capabilities (according to the
+     *  entries in the var structure). Return != 0 for invalid regno.
+     */
+
+static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
+			 u_int transp, struct fb_info *info)
+{
+	if (regno >= 256)	/* no. of hw registers */
+		return 1;
+	/*
+	 * Program hardware... do anything you want with transp
+	 */
+
+	/* grayscale works only partially under directcolor */
+	if (info->var.grayscale) {
+		/* grayscale = 0.30*R + 0.59*G + 0.11*B */
+		red = green = blue =
+		    (red * 77 + green * 151 + blue * 28) >> 8;
+	}
+
+	/* Directcolor:
+	 *   var->{color}.offset contains start of bitfield
+	 *   var->{color}.length contains length of bitfield
+	 *   {hardwarespecific} contains width of RAMDAC
+	 *   cmap[X] is programmed to (X << red.offset) | (X << green.offset) | (X << blue.offset)
 	 *   RAMDAC[X] is programmed to (red, green, blue)
 	 *
 	 * Pseudocolor:
@@ -353,87 +2404,3518 @@ static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 	 *                      (blue << blue.offset) | (transp << transp.offset)
 	 *    RAMDAC does not exist
 	 */
-#define CNVT_TOHW(val,width) ((((val)<<(width))+0x7FFF-(val))>>16)
-	switch (info->fix.visual) {
-	case FB_VISUAL_TRUECOLOR:
-	case FB_VISUAL_PSEUDOCOLOR:
-		red = CNVT_TOHW(red, info->var.red.length);
-		green = CNVT_TOHW(green, info->var.green.length);
-		blue = CNVT_TOHW(blue, info->var.blue.length);
-		transp = CNVT_TOHW(transp, info->var.transp.length);
-		break;
-	case FB_VISUAL_DIRECTCOLOR:
-		red = CNVT_TOHW(red, 8);	/* expect 8 bit DAC */
-		green = CNVT_TOHW(green, 8);
-		blue = CNVT_TOHW(blue, 8);
-		/* hey, there is bug in transp handling... */
-		transp = CNVT_TOHW(transp, 8);
+#define CNVT_TOHW(val,width) ((((val)<<(width))+0x7FFF-(val))>>16)
+	switch (info->fix.visual) {
+	case FB_VISUAL_TRUECOLOR:
+	case FB_VISUAL_PSEUDOCOLOR:
+		red = CNVT_TOHW(red, info->var.red.length);
+		green = CNVT_TOHW(green, info->var.green.length);
+		blue = CNVT_TOHW(blue, info->var.blue.length);
+		transp = CNVT_TOHW(transp, info->var.transp.length);
+		break;
+	case FB_VISUAL_DIRECTCOLOR:
+		red = CNVT_TOHW(red, 8);	/* expect 8 bit DAC */
+		green = CNVT_TOHW(green, 8);
+		blue = CNVT_TOHW(blue, 8);
+		/* hey, there is bug in transp handling... */
+		transp = CNVT_TOHW(transp, 8);
+		break;
+	}
+#undef CNVT_TOHW
+	/* Truecolor has hardware independent palette */
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR) {
+		u32 v;
+
+		if (regno >= 16)
+			return 1;
+
+		v = (red << info->var.red.offset) |
+		    (green << info->var.green.offset) |
+		    (blue << info->var.blue.offset) |
+		    (transp << info->var.transp.offset);
+		switch (info->var.bits_per_pixel) {
+		case 8:
+			break;
+		case 16:
+			((u32 *) (info->pseudo_palette))[regno] = v;
+			break;
+		case 24:
+		case 32:
+			((u32 *) (info->pseudo_palette))[regno] = v;
+			break;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+    /*
+     *  Pan or Wrap the Display
+     *
+     *  This call looks only at xoffset, yoffset and the FB_VMODE_YWRAP flag
+     */
+
+static int vfb_pan_display(struct fb_var_screeninfo *var,
+			   struct fb_info *info)
+{
+	struct vfb_offset offset;
+	int ret;
+
+	if (var->vmode & FB_VMODE_YWRAP) {
+		if (var->yoffset >= info->var.yres_virtual ||
+		    var->xoffset)
+			return -EINVAL;
+	} else {
+		if (var->xoffset + info->var.xres > info->var.xres_virtual ||
+		    var->yoffset + info->var.yres > info->var.yres_virtual)
+			return -EINVAL;
+	}
+
+	offset.xoffset = var->xoffset;
+	offset.yoffset = var->yoffset;
+	offset.ywrap = var->vmode & FB_VMODE_YWRAP;
+	ret = vfb_flip(info->par, &offset, var->activate & FB_ACTIVATE_VBL);
+	if (ret < 0)
+		return ret;
+
+	info->var.xoffset = var->xoffset;
+	info->var.yoffset = var->yoffset;
+	if (var->vmode & FB_VMODE_YWRAP)
+		info->var.vmode |= FB_VMODE_YWRAP;
+	else
+		info->var.vmode &= ~FB_VMODE_YWRAP;
+
+	vfb_notify(info->par, VFB_EVENT_PAN);
+	if (ret) {
+		vfb_notify(info->par, VFB_EVENT_FLIP);
+		vfb_capture_kick(info->par);
+		vfb_crc_kick(info->par);
+	}
+	return 0;
+}
+
+    /*
+     *  Pages are inserted into user mappings on demand by the fault handler,
+     *  which also does the allocation of lazy buffers.
+     */
+
+static vm_fault_t vfb_vm_fault(struct vm_fault *vmf)
+{
+	struct fb_info *info = vmf->vma->vm_private_data;
+	struct vfb_par *par = info->par;
+	struct page *page;
+	unsigned int gen;
+
+	page = vfb_get_page(par, vmf->pgoff, true, &gen);
+	if (!page) {
+		bool oom;
+
+		/*
+		 * Only a page of the array can fail to allocate. A mapping
+		 * made before the device switched to a memfd or dma-buf has
+		 * nothing to fault in.
+		 */
+		mutex_lock(&par->lock);
+		oom = par->mem->pages && vmf->pgoff < par->mem->npages;
+		mutex_unlock(&par->lock);
+
+		return oom ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	}
+
+	/* see vfb_resize_videomemory() */
+	lock_page(page);
+	if (gen != READ_ONCE(par->mem_gen)) {
+		unlock_page(page);
+		put_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+
+	vmf->page = page;
+	return VM_FAULT_LOCKED;
+}
+
+static vm_fault_t vfb_vm_page_mkwrite(struct vm_fault *vmf)
+{
+	struct fb_info *info = vmf->vma->vm_private_data;
+	struct vfb_par *par = info->par;
+	struct page *page = vmf->page;
+	unsigned long first = vmf->pgoff;
+	unsigned long nr = 1;
+	struct vfb_mem *mem;
+
+	lock_page(page);
+	mutex_lock(&par->lock);
+	mem = par->mem;
+	/* a page the buffer no longer has is zapped, see above */
+	if (vmf->pgoff >= mem->npages || !mem->pages || mem->pages[vmf->pgoff] != page) {
+		mutex_unlock(&par->lock);
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+
+	/* finish_fault() maps all of a huge page writable after this */
+	if (mem->alloc == VFB_ALLOC_HUGE) {
+		first = round_down(first, VFB_HUGE_NR);
+		nr = VFB_HUGE_NR;
+	}
+	vfb_set_dirty(par, first, nr);
+	vfb_snap_break(par->snaps, first, nr, GFP_KERNEL);
+	mutex_unlock(&par->lock);
+
+	return VM_FAULT_LOCKED;
+}
+
+static void vfb_vm_open(struct vm_area_struct *vma)
+{
+	struct fb_info *info = vma->vm_private_data;
+	struct vfb_par *par = info->par;
+
+	atomic_inc(&par->nr_mmaps);
+}
+
+static void vfb_vm_close(struct vm_area_struct *vma)
+{
+	struct fb_info *info = vma->vm_private_data;
+	struct vfb_par *par = info->par;
+
+	mutex_lock(&par->lock);
+	if (atomic_dec_and_test(&par->nr_mmaps))
+		par->mapping = NULL;
+	mutex_unlock(&par->lock);
+}
+
+static const struct vm_operations_struct vfb_vm_ops = {
+	.open		= vfb_vm_open,
+	.close		= vfb_vm_close,
+	.fault		= vfb_vm_fault,
+	.page_mkwrite	= vfb_vm_page_mkwrite,
+};
+
+static int vfb_mmap(struct fb_info *info,
+		    struct vm_area_struct *vma)
+{
+	struct vfb_par *par = info->par;
+	unsigned long npages;
+	struct file *shmem;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	mutex_lock(&par->lock);
+	npages = par->mem->npages;
+	if (vma->vm_pgoff >= npages ||
+	    vma_pages(vma) > npages - vma->vm_pgoff) {
+		mutex_unlock(&par->lock);
+		return -EINVAL;
+	}
+
+	if (par->mem->alloc == VFB_ALLOC_SHMEM) {
+		shmem = get_file(par->mem->shmem);
+		mutex_unlock(&par->lock);
+
+		/* as shmem_mmap() does for F_SEAL_FUTURE_WRITE */
+		if (vfb_shmem_sealed(shmem) && (vma->vm_flags & VM_SHARED)) {
+			if (vma->vm_flags & VM_WRITE) {
+				fput(shmem);
+				return -EPERM;
+			}
+			vm_flags_clear(vma, VM_MAYWRITE);
+		}
+
+		/* the mapping belongs to the shmem file from now on */
+		vma_set_file(vma, shmem);
+		fput(shmem);
+		return call_mmap(vma->vm_file, vma);
+	}
+
+	if (par->mem->alloc == VFB_ALLOC_DMABUF) {
+		dmabuf = par->mem->dmabuf;
+		get_dma_buf(dmabuf);
+		mutex_unlock(&par->lock);
+
+		/* likewise, the mapping moves to the dma-buf */
+		ret = dma_buf_mmap(dmabuf, vma, vma->vm_pgoff);
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	/*
+	 * Remembered so that a resize can zap the mappings. All of them
+	 * go through the same device node in practice.
+	 */
+	par->mapping = vma->vm_file->f_mapping;
+	atomic_inc(&par->nr_mmaps);
+	mutex_unlock(&par->lock);
+
+	/*
+	 * page_mkwrite makes the VMA write notify, see vma_wants_writenotify(),
+	 * for dirty tracking and snapshots. Costs a fault on the first write.
+	 */
+	vma->vm_ops = &vfb_vm_ops;
+	vma->vm_private_data = info;
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	return 0;
+}
+
+    /*
+     *  The shmem file of a shmem buffer with a reference held, or NULL.
+     */
+
+static struct file *vfb_get_shmem(struct vfb_par *par)
+{
+	struct file *shmem = NULL;
+
+	mutex_lock(&par->lock);
+	if (par->mem->alloc == VFB_ALLOC_SHMEM)
+		shmem = get_file(par->mem->shmem);
+	mutex_unlock(&par->lock);
+
+	return shmem;
+}
+
+    /*
+     *  The dma-buf of an imported buffer with a reference held, or NULL.
+     */
+
+static struct dma_buf *vfb_get_dmabuf(struct vfb_par *par)
+{
+	struct dma_buf *dmabuf = NULL;
+
+	mutex_lock(&par->lock);
+	if (par->mem->alloc == VFB_ALLOC_DMABUF) {
+		dmabuf = par->mem->dmabuf;
+		get_dma_buf(dmabuf);
+	}
+	mutex_unlock(&par->lock);
+
+	return dmabuf;
+}
+
+static int vfb_open(struct fb_info *info, int user)
+{
+	/* in-kernel clients draw through info->screen_buffer */
+	if (!user)
+		return vfb_map_kernel(info);
+	return 0;
+}
+
+static int vfb_release(struct fb_info *info, int user)
+{
+	if (!user)
+		vfb_unmap_kernel(info);
+	return 0;
+}
+
+    /*
+     *  read()/write() walk the page array, so they work on partially
+     *  backed buffers: reading a hole returns zeros without allocating.
+     *  Shmem buffers are read and written through their file, which takes
+     *  care of holes and swapped out pages. Imported dma-bufs are accessed
+     *  through a kernel mapping of their own, within CPU access brackets,
+     *  so a concurrent re-import can't pull the memory away.
+     *
+     *  All of it works on an iov_iter, which the data fd (VFBIO_GET_DATA_FD)
+     *  uses for read_iter/write_iter. Its splice_read has its own, see
+     *  there.
+     */
+
+static ssize_t vfb_shmem_rw(struct file *shmem, struct iov_iter *iter, loff_t *ppos)
+{
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	if (iov_iter_rw(iter) == READ) {
+		ret = vfs_iter_read(shmem, iter, &pos, 0);
+	} else {
+		if (vfb_shmem_sealed(shmem))
+			return -EPERM;
+		file_start_write(shmem);
+		ret = vfs_iter_write(shmem, iter, &pos, 0);
+		file_end_write(shmem);
+	}
+
+	if (ret > 0)
+		*ppos = pos;
+	return ret;
+}
+
+static ssize_t vfb_dmabuf_rw(struct dma_buf *dmabuf, struct iov_iter *iter, loff_t *ppos)
+{
+	bool write = iov_iter_rw(iter) == WRITE;
+	enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	size_t count = iov_iter_count(iter);
+	loff_t pos = *ppos;
+	struct iosys_map map;
+	size_t done = 0;
+	int ret;
+
+	if (pos >= dmabuf->size)
+		return write ? -ENOSPC : 0;
+	count = min_t(size_t, count, dmabuf->size - pos);
+
+	ret = dma_buf_vmap_unlocked(dmabuf, &map);
+	if (ret)
+		return ret;
+	if (map.is_iomem) {
+		dma_buf_vunmap_unlocked(dmabuf, &map);
+		return -EOPNOTSUPP;
+	}
+
+	ret = dma_buf_begin_cpu_access(dmabuf, dir);
+	if (!ret) {
+		if (write)
+			done = copy_from_iter(map.vaddr + pos, count, iter);
+		else
+			done = copy_to_iter(map.vaddr + pos, count, iter);
+		dma_buf_end_cpu_access(dmabuf, dir);
+	}
+	dma_buf_vunmap_unlocked(dmabuf, &map);
+
+	if (ret)
+		return ret;
+	if (!done)
+		return -EFAULT;
+
+	*ppos = pos + done;
+	return done;
+}
+
+static ssize_t vfb_pages_rw(struct vfb_par *par, struct iov_iter *iter, loff_t *ppos)
+{
+	bool write = iov_iter_rw(iter) == WRITE;
+	unsigned long p = *ppos;
+	ssize_t ret = 0;
+	int err = 0;
+
+	while (iov_iter_count(iter)) {
+		size_t offset = offset_in_page(p);
+		size_t c = min_t(size_t, iov_iter_count(iter), PAGE_SIZE - offset);
+		struct page *page = vfb_get_page(par, p >> PAGE_SHIFT, write, NULL);
+		size_t done;
+
+		if (page) {
+			if (write) {
+				vfb_snap_break(par->snaps, p >> PAGE_SHIFT, 1, GFP_KERNEL);
+				done = copy_page_from_iter(page, offset, c, iter);
+			} else {
+				done = copy_page_to_iter(page, offset, c, iter);
+			}
+			put_page(page);
+		} else if (write) {
+			err = -ENOMEM;
+			break;
+		} else {
+			done = iov_iter_zero(c, iter);
+		}
+
+		p += done;
+		ret += done;
+
+		if (done < c) {
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	if (write && ret) {
+		mutex_lock(&par->lock);
+		vfb_set_dirty(par, *ppos >> PAGE_SHIFT,
+			      ((p - 1) >> PAGE_SHIFT) - (*ppos >> PAGE_SHIFT) + 1);
+		mutex_unlock(&par->lock);
+	}
+
+	*ppos = p;
+	return ret ? ret : err;
+}
+
+    /*
+     *  Read or write at *ppos, the caller has cut iter down to the buffer.
+     */
+
+static ssize_t vfb_rw_iter(struct fb_info *info, struct iov_iter *iter, loff_t *ppos)
+{
+	struct vfb_par *par = info->par;
+	struct file *shmem;
+	struct dma_buf *dmabuf;
+	ssize_t ret;
+
+	if (!iov_iter_count(iter))
+		return 0;
+
+	shmem = vfb_get_shmem(par);
+	if (shmem) {
+		ret = vfb_shmem_rw(shmem, iter, ppos);
+		fput(shmem);
+		return ret;
+	}
+
+	dmabuf = vfb_get_dmabuf(par);
+	if (dmabuf) {
+		ret = vfb_dmabuf_rw(dmabuf, iter, ppos);
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	return vfb_pages_rw(par, iter, ppos);
+}
+
+    /*
+     *  Copy between buf and the video memory at pos for the driver's own
+     *  consumers. Page by page like read()/write(), so holes of lazy
+     *  buffers aren't filled, shmem isn't pinned, nothing is left mapped
+     *  and par->lock isn't held across the copy.
+     */
+
+static int vfb_mem_rw(struct fb_info *info, void *buf, size_t len, loff_t pos, bool write)
+{
+	struct kvec kvec = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kvec, 1, len);
+	ret = vfb_rw_iter(info, &iter, &pos);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EFAULT;
+}
+
+static ssize_t vfb_read(struct fb_info *info, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct vfb_par *par = info->par;
+	unsigned long p = *ppos;
+	unsigned long total_size = vfb_npages(par) << PAGE_SHIFT;
+	struct iov_iter iter;
+	int ret;
+
+	if (p >= total_size)
+		return 0;
+
+	if (count > total_size - p)
+		count = total_size - p;
+
+	ret = import_ubuf(ITER_DEST, buf, count, &iter);
+	if (ret)
+		return ret;
+
+	return vfb_rw_iter(info, &iter, ppos);
+}
+
+static ssize_t vfb_write(struct fb_info *info, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct vfb_par *par = info->par;
+	unsigned long p = *ppos;
+	unsigned long total_size = vfb_npages(par) << PAGE_SHIFT;
+	struct iov_iter iter;
+	ssize_t ret;
+	int err = 0;
+
+	if (p > total_size)
+		return -EFBIG;
+
+	if (count > total_size) {
+		err = -EFBIG;
+		count = total_size;
+	}
+
+	if (count + p > total_size) {
+		if (!err)
+			err = -ENOSPC;
+
+		count = total_size - p;
+	}
+
+	ret = import_ubuf(ITER_SOURCE, (void __user *)buf, count, &iter);
+	if (ret)
+		return ret;
+
+	ret = vfb_rw_iter(info, &iter, ppos);
+	return ret ? ret : err;
+}
+
+    /*
+     *  Damage accumulator
+     *
+     *  Producers submit the rectangles they redrew with VFBIO_DAMAGE, the
+     *  drawing ops below add theirs, consumers fetch and reset the lot with
+     *  VFBIO_GET_DAMAGE or VFBIO_GET_UPDATE. Up to VFB_DAMAGE_RECTS
+     *  rectangles are kept. A new one absorbs those it can be merged with
+     *  without covering more than both did, when there is no room left it
+     *  is merged into the one that grows the least. Coordinates are in the
+     *  virtual screen.
+     *
+     *  sys_copyarea() is recorded as a copy hint instead, up to
+     *  VFB_COPY_HINTS of them in order. Consumers replay the copies on
+     *  their last frame, then fetch the damage. So damage a copy reads from
+     *  moves along with it. When there is no room for another copy, or no
+     *  room in the caller's array, the copies are folded into the damage.
+     */
+
+static u64 vfb_rect_area(const struct vfb_rect *r)
+{
+	return (u64)r->width * r->height;
+}
+
+static void vfb_rect_union(struct vfb_rect *r, const struct vfb_rect *a)
+{
+	u32 x2 = max(r->x + r->width, a->x + a->width);
+	u32 y2 = max(r->y + r->height, a->y + a->height);
+
+	r->x = min(r->x, a->x);
+	r->y = min(r->y, a->y);
+	r->width = x2 - r->x;
+	r->height = y2 - r->y;
+}
+
+static bool vfb_rect_intersect(struct vfb_rect *r, const struct vfb_rect *a)
+{
+	u32 x1 = max(r->x, a->x);
+	u32 y1 = max(r->y, a->y);
+	u32 x2 = min(r->x + r->width, a->x + a->width);
+	u32 y2 = min(r->y + r->height, a->y + a->height);
+
+	if (x1 >= x2 || y1 >= y2)
+		return false;
+
+	r->x = x1;
+	r->y = y1;
+	r->width = x2 - x1;
+	r->height = y2 - y1;
+	return true;
+}
+
+static bool vfb_rect_clip(struct vfb_rect *r, const struct fb_info *info)
+{
+	const struct vfb_rect screen = {
+		.width = info->var.xres_virtual,
+		.height = info->var.yres_virtual,
+	};
+
+	return r->width && r->height && vfb_rect_intersect(r, &screen);
+}
+
+static void vfb_rects_add(struct vfb_rect *rects, unsigned int *n, unsigned int max,
+			  struct vfb_rect rect)
+{
+	struct vfb_rect u;
+	unsigned int i, best = 0;
+	u64 growth, best_growth = U64_MAX;
+
+	i = 0;
+	while (i < *n) {
+		u = rect;
+		vfb_rect_union(&u, &rects[i]);
+		if (vfb_rect_area(&u) > vfb_rect_area(&rect) + vfb_rect_area(&rects[i])) {
+			i++;
+			continue;
+		}
+
+		/* absorbed, the grown one may absorb earlier ones now */
+		rect = u;
+		rects[i] = rects[--*n];
+		i = 0;
+	}
+
+	if (*n < max) {
+		rects[(*n)++] = rect;
+		return;
+	}
+
+	for (i = 0; i < *n; i++) {
+		u = rects[i];
+		vfb_rect_union(&u, &rect);
+		growth = vfb_rect_area(&u) - vfb_rect_area(&rects[i]);
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = i;
+		}
+	}
+	vfb_rect_union(&rects[best], &rect);
+}
+
+static void vfb_copies_fold(struct vfb_copy_rect *copies, unsigned int *nr_copies,
+			    struct vfb_rect *rects, unsigned int *nr_rects)
+{
+	unsigned int i;
+
+	for (i = 0; i < *nr_copies; i++)
+		vfb_rects_add(rects, nr_rects, VFB_DAMAGE_RECTS, copies[i].dst);
+	*nr_copies = 0;
+}
+
+static void vfb_capture_damage_add(struct vfb_par *par, const struct vfb_rect *rect)
+{
+	if (!par->capture_damage.width)
+		par->capture_damage = *rect;
+	else
+		vfb_rect_union(&par->capture_damage, rect);
+}
+
+static void vfb_damage_add(struct fb_info *info, u32 x, u32 y, u32 width, u32 height)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_rect rect = { x, y, width, height };
+	unsigned long flags;
+
+	if (!vfb_rect_clip(&rect, info))
+		return;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	vfb_rects_add(par->damage, &par->nr_damage, VFB_DAMAGE_RECTS, rect);
+	vfb_capture_damage_add(par, &rect);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	vfb_notify(par, VFB_EVENT_DAMAGE);
+	vfb_vblank_kick(par);
+}
+
+/* damage the copy reads from goes along with it */
+static void vfb_rects_move(struct vfb_rect *rects, unsigned int *nr_rects,
+			   const struct vfb_copy_rect *copy)
+{
+	struct vfb_rect src = { copy->src_x, copy->src_y, copy->dst.width, copy->dst.height };
+	struct vfb_rect moved[VFB_DAMAGE_RECTS];
+	unsigned int i, n = 0;
+
+	for (i = 0; i < *nr_rects; i++) {
+		struct vfb_rect r = rects[i];
+
+		if (!vfb_rect_intersect(&r, &src))
+			continue;
+		r.x = r.x - src.x + copy->dst.x;
+		r.y = r.y - src.y + copy->dst.y;
+		moved[n++] = r;
+	}
+	for (i = 0; i < n; i++)
+		vfb_rects_add(rects, nr_rects, VFB_DAMAGE_RECTS, moved[i]);
+}
+
+static void vfb_copy_add(struct fb_info *info, const struct fb_copyarea *area)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_rect src = { area->sx, area->sy, area->width, area->height };
+	struct vfb_rect dst = { area->dx, area->dy, area->width, area->height };
+	struct vfb_copy_rect *copy;
+	unsigned long flags;
+
+	if (!vfb_rect_clip(&src, info) || !vfb_rect_clip(&dst, info) ||
+	    src.width != area->width || src.height != area->height ||
+	    dst.width != area->width || dst.height != area->height) {
+		/* not a plain copy within the screen */
+		vfb_damage_add(info, area->dx, area->dy, area->width, area->height);
+		return;
+	}
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	if (par->nr_copies == VFB_COPY_HINTS)
+		vfb_copies_fold(par->copies, &par->nr_copies, par->damage, &par->nr_damage);
+
+	copy = &par->copies[par->nr_copies++];
+	copy->src_x = src.x;
+	copy->src_y = src.y;
+	copy->dst = dst;
+	vfb_rects_move(par->damage, &par->nr_damage, copy);
+	vfb_capture_damage_add(par, &dst);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	vfb_notify(par, VFB_EVENT_DAMAGE);
+	vfb_vblank_kick(par);
+}
+
+    /*
+     *  Put back what a consumer took but couldn't hand out. Its copies are
+     *  folded into its damage, which then follows the copies recorded
+     *  since, as if it had never been taken.
+     */
+
+static void vfb_damage_restore(struct vfb_par *par,
+			       struct vfb_copy_rect *copies, unsigned int nr_copies,
+			       struct vfb_rect *rects, unsigned int nr_rects)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	vfb_copies_fold(copies, &nr_copies, rects, &nr_rects);
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	for (i = 0; i < par->nr_copies; i++)
+		vfb_rects_move(rects, &nr_rects, &par->copies[i]);
+	for (i = 0; i < nr_rects; i++)
+		vfb_rects_add(par->damage, &par->nr_damage, VFB_DAMAGE_RECTS, rects[i]);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+}
+
+    /*
+     *  Capture ring (VFBIO_CAPTURE)
+     *
+     *  A work item copies the visible frame into the next slot on every
+     *  pan and, with an interval, periodically. It copies like read(),
+     *  taking par->lock per page only, so writers aren't held up for a
+     *  frame; if the buffer shrank meanwhile the frame is dropped. It
+     *  never takes the pool or the fb lock, and consumers read the ring
+     *  through their mapping without any lock, see vfb.h. The damage of a
+     *  slot is the bounding box of what was submitted or drawn since the
+     *  previous one, writes through a mapping that aren't reported with
+     *  VFBIO_DAMAGE don't show up in it.
+     */
+
+struct vfb_ring {
+	struct kref kref;		/* the device while capturing, and each fd */
+	struct vfb_capture_header *hdr;	/* start of the mapping */
+	void *data;			/* frame of slot 0 */
+	size_t size;
+	u32 nr_slots;
+	u32 interval_ms;
+	u64 slot_size;
+	u64 frame;			/* last published, written by the work item only */
+};
+
+static void vfb_ring_free(struct kref *kref)
+{
+	struct vfb_ring *ring = container_of(kref, struct vfb_ring, kref);
+
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+static struct vfb_ring *vfb_ring_alloc(u32 nr_slots, u32 interval_ms, u64 frame_size)
+{
+	size_t hdr_size = PAGE_ALIGN(sizeof(struct vfb_capture_header) +
+				     nr_slots * sizeof(struct vfb_capture_slot));
+	struct vfb_ring *ring;
+
+	if (PAGE_ALIGN(frame_size) > (SIZE_MAX - hdr_size) / nr_slots)
+		return NULL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	kref_init(&ring->kref);
+	ring->nr_slots = nr_slots;
+	ring->interval_ms = interval_ms;
+	ring->slot_size = PAGE_ALIGN(frame_size);
+	ring->size = hdr_size + nr_slots * ring->slot_size;
+
+	/* zeroed, so all slots start out even and empty */
+	ring->hdr = vmalloc_user(ring->size);
+	if (!ring->hdr) {
+		kfree(ring);
+		return NULL;
+	}
+	ring->data = (void *)ring->hdr + hdr_size;
+
+	ring->hdr->nr_slots = nr_slots;
+	ring->hdr->slot_size = ring->slot_size;
+	ring->hdr->data_offset = hdr_size;
+	return ring;
+}
+
+static size_t vfb_capture_stride(const struct fb_var_screeninfo *var)
+{
+	return DIV_ROUND_UP((size_t)var->xres * var->bits_per_pixel, 8);
+}
+
+static void vfb_capture_publish(struct vfb_par *par, struct vfb_ring *ring)
+{
+	struct fb_info *info = par->info;
+	/* may change under us, the copy only has to stay in bounds */
+	struct fb_var_screeninfo var = info->var;
+	size_t line_length = info->fix.line_length;
+	size_t stride = vfb_capture_stride(&var);
+	size_t first;
+	struct vfb_capture_slot *slot;
+	struct vfb_rect damage;
+	unsigned long flags;
+	unsigned int i;
+	bool full;
+	u64 frame;
+	void *dst;
+	u32 y, row;
+
+	vfb_front(par, &var);
+	first = (size_t)var.xoffset * var.bits_per_pixel / 8;
+
+	if (!var.yres || var.yres > var.yres_virtual || var.yoffset >= var.yres_virtual ||
+	    (u64)stride * var.yres > ring->slot_size)
+		return;
+
+	/* changes from here on are in the next frame as well */
+	spin_lock_irqsave(&par->damage_lock, flags);
+	damage = par->capture_damage;
+	full = par->capture_full;
+	memset(&par->capture_damage, 0, sizeof(par->capture_damage));
+	par->capture_full = false;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	if (full || (damage.width && (var.vmode & FB_VMODE_YWRAP))) {
+		damage = (struct vfb_rect){ 0, 0, var.xres, var.yres };
+	} else if (damage.width) {
+		const struct vfb_rect visible = { var.xoffset, var.yoffset, var.xres, var.yres };
+
+		if (vfb_rect_intersect(&damage, &visible)) {
+			damage.x -= var.xoffset;
+			damage.y -= var.yoffset;
+		} else {
+			memset(&damage, 0, sizeof(damage));
+		}
+	}
+
+	frame = ring->frame + 1;
+	i = frame % ring->nr_slots;
+	slot = &ring->hdr->slots[i];
+	dst = ring->data + i * ring->slot_size;
+
+	if ((u64)(var.yres_virtual - 1) * line_length + first + stride >
+	    (u64)vfb_npages(par) << PAGE_SHIFT) {
+		vfb_capture_damage_all(par);
+		return;
+	}
+
+	WRITE_ONCE(slot->seq, slot->seq + 1);
+	smp_wmb();
+	for (y = 0; y < var.yres; y++) {
+		row = var.yoffset + y;
+		if (row >= var.yres_virtual)
+			row -= var.yres_virtual;	/* FB_VMODE_YWRAP */
+		if (vfb_mem_rw(info, dst + y * stride, stride,
+				(loff_t)row * line_length + first, false)) {
+			/* the buffer was replaced, no frame has number 0 */
+			slot->frame = 0;
+			smp_wmb();
+			WRITE_ONCE(slot->seq, slot->seq + 1);
+			vfb_capture_damage_all(par);
+			return;
+		}
+	}
+
+	slot->frame = frame;
+	slot->timestamp = ktime_get_ns();
+	slot->width = var.xres;
+	slot->height = var.yres;
+	slot->stride = stride;
+	slot->bits_per_pixel = var.bits_per_pixel;
+	slot->damage = damage;
+	smp_wmb();
+	WRITE_ONCE(slot->seq, slot->seq + 1);
+
+	ring->frame = frame;
+	smp_store_release(&ring->hdr->head, frame);
+
+	vfb_notify(par, VFB_EVENT_CAPTURE);
+}
+
+static void vfb_capture_work(struct work_struct *work)
+{
+	struct vfb_par *par = container_of(to_delayed_work(work), struct vfb_par,
+					   capture_work);
+	struct vfb_ring *ring = READ_ONCE(par->ring);
+
+	if (!ring)
+		return;
+
+	vfb_capture_publish(par, ring);
+	if (ring->interval_ms)
+		queue_delayed_work(system_wq, &par->capture_work,
+				   msecs_to_jiffies(ring->interval_ms));
+}
+
+static void vfb_capture_stop(struct vfb_par *par)
+{
+	struct vfb_ring *ring = par->ring;
+
+	if (!ring)
+		return;
+
+	/* the work item sees NULL from here on, wait for one that didn't */
+	WRITE_ONCE(par->ring, NULL);
+	cancel_delayed_work_sync(&par->capture_work);
+	kref_put(&ring->kref, vfb_ring_free);
+}
+
+static int vfb_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct vfb_ring *ring = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, ring->hdr, vma->vm_pgoff);
+}
+
+static int vfb_ring_release(struct inode *inode, struct file *file)
+{
+	struct vfb_ring *ring = file->private_data;
+
+	kref_put(&ring->kref, vfb_ring_free);
+	return 0;
+}
+
+static const struct file_operations vfb_ring_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= vfb_ring_mmap,
+	.release	= vfb_ring_release,
+	.llseek		= noop_llseek,
+};
+
+    /*
+     *  Motion detection (VFBIO_GET_UPDATE with VFB_UPDATE_DETECT)
+     *
+     *  For producers that scroll through a mapping instead of the drawing
+     *  ops, the frame is compared with the one of the previous detection
+     *  by hashes, no copy of it is kept:
+     *
+     *  - every line is hashed. Changed lines vote for the offset at which
+     *    an old line with the same hash sits, lines whose hash is common
+     *    (blank ones) don't vote. The winning offset becomes one vertical
+     *    copy spanning the lines it explains.
+     *  - every column is hashed per band of VFB_TILE_SIZE lines (bpp >= 8).
+     *    Bands outside the vertical copy look for a horizontal offset the
+     *    same way, e.g. a sideways scrolling window.
+     *
+     *  What the copies don't explain becomes damage, lines or columns
+     *  within a band. This costs a pass over the frame per detection.
+     */
+
+#define VFB_MOTION_MIN_VOTES	8	/* lines or columns backing an offset */
+#define VFB_MOTION_MAX_DUPS	4	/* hashes seen more often don't vote */
+#define VFB_MOTION_FNV_BASIS	0xcbf29ce484222325ULL
+#define VFB_MOTION_FNV_PRIME	0x100000001b3ULL
+
+struct vfb_motion_key {
+	u64 hash;
+	u32 pos;
+};
+
+static int vfb_motion_key_cmp(const void *a, const void *b)
+{
+	const struct vfb_motion_key *ka = a, *kb = b;
+
+	if (ka->hash != kb->hash)
+		return ka->hash < kb->hash ? -1 : 1;
+	return 0;
+}
+
+static int vfb_motion_alloc(struct vfb_motion *m, u32 width, u32 height, bool cols)
+{
+	m->width = width;
+	m->height = height;
+	m->bands = DIV_ROUND_UP(height, VFB_TILE_SIZE);
+
+	m->rows = kvmalloc_array(height, sizeof(*m->rows), GFP_KERNEL);
+	if (!m->rows)
+		return -ENOMEM;
+
+	if (cols) {
+		m->cols = kvmalloc_array((size_t)m->bands * width, sizeof(*m->cols), GFP_KERNEL);
+		if (!m->cols) {
+			kvfree(m->rows);
+			m->rows = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static u32 vfb_motion_pixel(const u8 *p, u32 cpp)
+{
+	switch (cpp) {
+	case 4:
+		return get_unaligned((const u32 *)p);
+	case 3:
+		return p[0] | (p[1] << 8) | (p[2] << 16);
+	case 2:
+		return get_unaligned((const u16 *)p);
+	default:
+		return p[0];
+	}
+}
+
+static void vfb_motion_hash(struct fb_info *info, struct vfb_motion *m)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 cpp = bpp / 8;
+	size_t len = DIV_ROUND_UP((size_t)m->width * bpp, 8);
+	const u8 *line = info->screen_buffer;
+	u64 *c = NULL;
+	u32 x, y;
+
+	for (y = 0; y < m->height; y++, line += info->fix.line_length) {
+		m->rows[y] = xxh64(line, len, 0);
+
+		if (!m->cols)
+			continue;
+
+		if (y % VFB_TILE_SIZE == 0) {
+			c = m->cols + (size_t)(y / VFB_TILE_SIZE) * m->width;
+			for (x = 0; x < m->width; x++)
+				c[x] = VFB_MOTION_FNV_BASIS;
+			cond_resched();
+		}
+		for (x = 0; x < m->width; x++)
+			c[x] = (c[x] ^ vfb_motion_pixel(line + x * cpp, cpp)) * VFB_MOTION_FNV_PRIME;
+	}
+}
+
+    /*
+     *  Find the offset d, new[i] == old[i - d], most changed entries of
+     *  new agree on. Returns 0 if there is none worth a copy.
+     */
+
+static int vfb_motion_offset(const u64 *old, const u64 *new, u32 n,
+			     struct vfb_motion_key *keys, u32 *votes)
+{
+	u32 i, j, k, changed = 0, best_votes = 0;
+	int best = 0;
+
+	for (i = 0; i < n; i++) {
+		keys[i].hash = old[i];
+		keys[i].pos = i;
+	}
+	sort(keys, n, sizeof(*keys), vfb_motion_key_cmp, NULL);
+	memset(votes, 0, 2 * n * sizeof(*votes));
+
+	for (i = 0; i < n; i++) {
+		struct vfb_motion_key key = { .hash = new[i] };
+		struct vfb_motion_key *hit;
+
+		if (new[i] == old[i])
+			continue;
+		changed++;
+
+		hit = bsearch(&key, keys, n, sizeof(*keys), vfb_motion_key_cmp);
+		if (!hit)
+			continue;
+
+		/* widen to the run of equal hashes */
+		j = k = hit - keys;
+		while (j > 0 && keys[j - 1].hash == key.hash)
+			j--;
+		while (k + 1 < n && keys[k + 1].hash == key.hash)
+			k++;
+		if (k - j + 1 > VFB_MOTION_MAX_DUPS)
+			continue;
+
+		for (; j <= k; j++)
+			if (keys[j].pos != i)
+				votes[n + i - keys[j].pos]++;
+	}
+
+	for (i = 0; i < 2 * n; i++) {
+		if (votes[i] > best_votes) {
+			best_votes = votes[i];
+			best = (int)i - (int)n;
+		}
+	}
+
+	if (best_votes < max_t(u32, VFB_MOTION_MIN_VOTES, changed / 4))
+		return 0;
+	return best;
+}
+
+    /*
+     *  First and last entry of new explained by a copy from offset d that
+     *  isn't explained by staying in place. Returns false if none is.
+     */
+
+static bool vfb_motion_span(const u64 *old, const u64 *new, u32 n, int d,
+			    u32 *first, u32 *last)
+{
+	bool found = false;
+	u32 i;
+
+	for (i = max(d, 0); i < n && (int)i - d < (int)n; i++) {
+		if (new[i] != old[i - d] || new[i] == old[i])
+			continue;
+		if (!found)
+			*first = i;
+		*last = i;
+		found = true;
+	}
+
+	return found;
+}
+
+struct vfb_motion_result {
+	struct vfb_copy_rect copies[VFB_COPY_HINTS];
+	unsigned int nr_copies;
+	struct vfb_rect rects[VFB_DAMAGE_RECTS];
+	unsigned int nr_rects;
+};
+
+static void vfb_motion_copy(struct vfb_motion_result *res, u32 sx, u32 sy,
+			    u32 dx, u32 dy, u32 width, u32 height)
+{
+	struct vfb_copy_rect *prev = res->nr_copies ? &res->copies[res->nr_copies - 1] : NULL;
+	struct vfb_rect dst = { dx, dy, width, height };
+
+	/* the same horizontal move in the band above grows downwards */
+	if (prev && prev->dst.x == dx && prev->dst.width == width &&
+	    prev->dst.y + prev->dst.height == dy && prev->src_x == sx &&
+	    prev->src_y + prev->dst.height == sy) {
+		prev->dst.height += height;
+		return;
+	}
+
+	if (res->nr_copies == VFB_COPY_HINTS) {
+		vfb_rects_add(res->rects, &res->nr_rects, VFB_DAMAGE_RECTS, dst);
+		return;
+	}
+
+	res->copies[res->nr_copies].src_x = sx;
+	res->copies[res->nr_copies].src_y = sy;
+	res->copies[res->nr_copies].dst = dst;
+	res->nr_copies++;
+}
+
+    /*
+     *  Damage runs of entries of [from, to) where changed() holds, as full
+     *  width lines (band < 0) or as columns of the lines of a band.
+     */
+
+static void vfb_motion_damage(struct vfb_motion_result *res, const struct vfb_motion *m,
+			      const u64 *old, const u64 *new, u32 from, u32 to,
+			      int d, u32 span_first, u32 span_last, int band)
+{
+	struct vfb_rect r;
+	u32 i, start = 0;
+	bool in_run = false;
+
+	for (i = from; i <= to; i++) {
+		bool changed = false;
+
+		if (i < to) {
+			if (d && i >= span_first && i <= span_last)
+				changed = new[i] != old[i - d];
+			else
+				changed = new[i] != old[i];
+		}
+
+		if (changed && !in_run) {
+			start = i;
+			in_run = true;
+		} else if (!changed && in_run) {
+			in_run = false;
+			if (band < 0) {
+				r = (struct vfb_rect){ 0, start, m->width, i - start };
+			} else {
+				r.x = start;
+				r.y = band * VFB_TILE_SIZE;
+				r.width = i - start;
+				r.height = min_t(u32, VFB_TILE_SIZE, m->height - r.y);
+			}
+			vfb_rects_add(res->rects, &res->nr_rects, VFB_DAMAGE_RECTS, r);
+		}
+	}
+}
+
+static void vfb_motion_detect(const struct vfb_motion *old, const struct vfb_motion *new,
+			      struct vfb_motion_result *res, struct vfb_motion_key *keys,
+			      u32 *votes)
+{
+	u32 vfirst = 0, vlast = 0, hfirst = 0, hlast = 0, y0, y1, b;
+	int d, dx;
+
+	d = vfb_motion_offset(old->rows, new->rows, new->height, keys, votes);
+	if (d && vfb_motion_span(old->rows, new->rows, new->height, d, &vfirst, &vlast))
+		vfb_motion_copy(res, 0, vfirst - d, 0, vfirst, new->width, vlast - vfirst + 1);
+	else
+		d = 0;
+
+	for (b = 0; b < new->bands; b++) {
+		const u64 *oc, *nc;
+
+		y0 = b * VFB_TILE_SIZE;
+		y1 = min_t(u32, y0 + VFB_TILE_SIZE, new->height);
+
+		if (!new->cols || (d && y0 <= vlast && vfirst < y1) ||
+		    !memcmp(old->rows + y0, new->rows + y0, (y1 - y0) * sizeof(u64))) {
+			vfb_motion_damage(res, new, old->rows, new->rows, y0, y1,
+					  d, vfirst, vlast, -1);
+			continue;
+		}
+
+		oc = old->cols + (size_t)b * new->width;
+		nc = new->cols + (size_t)b * new->width;
+		dx = vfb_motion_offset(oc, nc, new->width, keys, votes);
+		if (dx && vfb_motion_span(oc, nc, new->width, dx, &hfirst, &hlast))
+			vfb_motion_copy(res, hfirst - dx, y0, hfirst, y0,
+					hlast - hfirst + 1, y1 - y0);
+		else
+			dx = 0;
+
+		vfb_motion_damage(res, new, oc, nc, 0, new->width, dx, hfirst, hlast, b);
+	}
+}
+
+    /*
+     *  Drawing is skipped while a lazy buffer has no kernel mapping, i.e.
+     *  no in-kernel client has opened the device.
+     */
+
+static void vfb_snap_break_lines(struct fb_info *info, u32 y, u32 height)
+{
+	struct vfb_par *par = info->par;
+	u64 first = (u64)y * info->fix.line_length;
+	u64 end = (u64)(y + height) * info->fix.line_length;
+
+	if (height)
+		vfb_snap_break(par->snaps, first >> PAGE_SHIFT,
+			       ((end - 1) >> PAGE_SHIFT) - (first >> PAGE_SHIFT) + 1,
+			       GFP_ATOMIC);
+}
+
+    /*
+     *  Solid fills
+     *
+     *  fbcon clears and scrolls with fillrect. sys_fillrect goes a long at
+     *  a time through bit offsets for any depth. The ROP_COPY fills at 16
+     *  and 32 bpp are memset16/memset32 per line instead, rep stos on x86,
+     *  and 24 bpp stores longs of a pattern repeating every 24 bytes. Fills
+     *  from VFB_FILL_NT_BYTES use non-temporal SSE2 or AVX2 stores when the
+     *  FPU is usable: nothing reads them back soon, and they would only
+     *  evict the rest of the cache. Anything else is left to sys_fillrect.
+     *  debugfs vfb/fbN/fillrect_bench compares the two on a scratch buffer.
+     *
+     *  The pattern holds pixels from byte 0, so that pat + o % cpp lines
+     *  up with byte o of a line, and is valid for VFB_FILL_CHUNK + cpp - 1
+     *  bytes from there.
+     */
+
+static void vfb_fill_pattern(u8 *pat, u32 fg, unsigned int cpp)
+{
+	unsigned int i;
+
+	for (i = 0; i <= VFB_FILL_CHUNK; i += cpp) {
+		switch (cpp) {
+		case 2:
+			put_unaligned((u16)fg, (u16 *)(pat + i));
+			break;
+		case 3:
+			put_unaligned_le24(fg, pat + i);
+			break;
+		case 4:
+			put_unaligned(fg, (u32 *)(pat + i));
+			break;
+		}
+	}
+}
+
+    /*
+     *  Any depth and alignment: bytes up to a long boundary, then three
+     *  longs at a time, which hold a whole number of pixels at 2, 3 and 4
+     *  bytes, then the rest. pat[0] is the pixel byte of dst[0].
+     */
+
+static void vfb_fill_bytes(u8 *dst, const u8 *pat, size_t len)
+{
+	size_t head = min_t(size_t, len, -(unsigned long)dst & 7);
+	size_t done;
+	u64 w0, w1, w2;
+	u64 *d;
+
+	memcpy(dst, pat, head);
+	w0 = get_unaligned((const u64 *)(pat + head));
+	w1 = get_unaligned((const u64 *)(pat + head + 8));
+	w2 = get_unaligned((const u64 *)(pat + head + 16));
+
+	d = (u64 *)(dst + head);
+	for (done = head; len - done >= 24; done += 24) {
+		*d++ = w0;
+		*d++ = w1;
+		*d++ = w2;
+	}
+	memcpy(dst + done, pat + done % 24, len - done);
+}
+
+#ifdef CONFIG_X86_64
+static void vfb_fill_nt_sse2(u8 *dst, const u8 *pat, size_t n)
+{
+	asm volatile("movdqu   (%0), %%xmm0\n\t"
+		     "movdqu 16(%0), %%xmm1\n\t"
+		     "movdqu 32(%0), %%xmm2\n\t"
+		     "movdqu 48(%0), %%xmm3\n\t"
+		     "movdqu 64(%0), %%xmm4\n\t"
+		     "movdqu 80(%0), %%xmm5"
+		     : : "r" (pat) : "memory");
+
+	for (; n; n--, dst += VFB_FILL_CHUNK)
+		asm volatile("movntdq %%xmm0,   (%0)\n\t"
+			     "movntdq %%xmm1, 16(%0)\n\t"
+			     "movntdq %%xmm2, 32(%0)\n\t"
+			     "movntdq %%xmm3, 48(%0)\n\t"
+			     "movntdq %%xmm4, 64(%0)\n\t"
+			     "movntdq %%xmm5, 80(%0)"
+			     : : "r" (dst) : "memory");
+}
+
+static void vfb_fill_nt_avx2(u8 *dst, const u8 *pat, size_t n)
+{
+	asm volatile("vmovdqu   (%0), %%ymm0\n\t"
+		     "vmovdqu 32(%0), %%ymm1\n\t"
+		     "vmovdqu 64(%0), %%ymm2"
+		     : : "r" (pat) : "memory");
+
+	for (; n; n--, dst += VFB_FILL_CHUNK)
+		asm volatile("vmovntdq %%ymm0,   (%0)\n\t"
+			     "vmovntdq %%ymm1, 32(%0)\n\t"
+			     "vmovntdq %%ymm2, 64(%0)"
+			     : : "r" (dst) : "memory");
+
+	/* no AVX-SSE transition penalty for SSE code until kernel_fpu_end() */
+	asm volatile("vzeroupper" : : : "memory");
+}
+
+    /*
+     *  The FPU is taken per line, not to keep preemption off for a whole
+     *  screen.
+     */
+
+static bool vfb_fill_rect_nt(u8 *dst, const u8 *pat, unsigned int cpp,
+			     size_t len, u32 pitch, u32 height)
+{
+	bool avx2 = boot_cpu_has(X86_FEATURE_AVX2);
+	unsigned long mask = avx2 ? 31 : 15;
+
+	if (len * height < VFB_FILL_NT_BYTES || len < VFB_FILL_NT_LINE || !irq_fpu_usable())
+		return false;
+
+	for (; height; height--, dst += pitch) {
+		size_t head = min_t(size_t, len, -(unsigned long)dst & mask);
+		size_t n = (len - head) / VFB_FILL_CHUNK;
+		size_t done = head + n * VFB_FILL_CHUNK;
+
+		vfb_fill_bytes(dst, pat, head);
+		kernel_fpu_begin();
+		if (avx2)
+			vfb_fill_nt_avx2(dst + head, pat + head % cpp, n);
+		else
+			vfb_fill_nt_sse2(dst + head, pat + head % cpp, n);
+		kernel_fpu_end();
+		vfb_fill_bytes(dst + done, pat + done % cpp, len - done);
+	}
+
+	/* order the non-temporal stores before whoever is told of them */
+	wmb();
+	return true;
+}
+#else
+static bool vfb_fill_rect_nt(u8 *dst, const u8 *pat, unsigned int cpp,
+			     size_t len, u32 pitch, u32 height)
+{
+	return false;
+}
+#endif
+
+    /*
+     *  Returns false if it's for sys_fillrect.
+     */
+
+static bool vfb_fill(struct fb_info *info, const struct fb_fillrect *rect)
+{
+	unsigned int cpp = info->var.bits_per_pixel / 8;
+	size_t len = (size_t)rect->width * cpp;
+	u32 pitch = info->fix.line_length;
+	u8 pat[VFB_FILL_CHUNK + 4];
+	u8 *dst;
+	u32 fg, y;
+
+	if (rect->rop != ROP_COPY || info->state != FBINFO_STATE_RUNNING)
+		return false;
+
+	switch (info->var.bits_per_pixel) {
+	case 16:
+	case 24:
+	case 32:
 		break;
+	default:
+		return false;
+	}
+
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR ||
+	    info->fix.visual == FB_VISUAL_DIRECTCOLOR)
+		fg = ((u32 *)info->pseudo_palette)[rect->color];
+	else
+		fg = rect->color;
+
+	dst = (u8 *)info->screen_buffer + (size_t)rect->dy * pitch + (size_t)rect->dx * cpp;
+	vfb_fill_pattern(pat, fg, cpp);
+
+	if (vfb_fill_rect_nt(dst, pat, cpp, len, pitch, rect->height))
+		return true;
+
+	for (y = 0; y < rect->height; y++, dst += pitch) {
+		if (cpp == 4 && IS_ALIGNED((unsigned long)dst, 4))
+			memset32((u32 *)dst, fg, rect->width);
+		else if (cpp == 2 && IS_ALIGNED((unsigned long)dst, 2))
+			memset16((u16 *)dst, fg, rect->width);
+		else
+			vfb_fill_bytes(dst, pat, len);
+	}
+	return true;
+}
+
+    /*
+     *  debugfs vfb/fbN/fillrect_bench: times sys_fillrect and vfb_fill()
+     *  at the current mode on scratch buffers, for the screen, a 256x256
+     *  block and a glyph cell, and checks that they draw the same.
+     */
+
+static u64 vfb_fill_bench_one(struct fb_info *info, const struct fb_fillrect *rect,
+			      bool sys, unsigned int loops)
+{
+	u64 start = ktime_get_ns();
+	unsigned int i;
+
+	for (i = 0; i < loops; i++) {
+		if (sys || !vfb_fill(info, rect))
+			sys_fillrect(info, rect);
+		if (!(i % 64))
+			cond_resched();
+	}
+	return div_u64(ktime_get_ns() - start, loops);
+}
+
+static int vfb_fill_bench_show(struct seq_file *m, void *unused)
+{
+	struct fb_info *info = m->private;
+	struct fb_info *tmp;
+	void *a = NULL, *b = NULL;
+	size_t size;
+	int i, ret = 0;
+
+	/* only what the fill paths look at, the rest stays unused */
+	tmp = framebuffer_alloc(0, NULL);
+	if (!tmp)
+		return -ENOMEM;
+
+	lock_fb_info(info);
+	tmp->var = info->var;
+	tmp->fix = info->fix;
+	tmp->pseudo_palette = info->pseudo_palette;
+	tmp->state = info->state;
+	tmp->flags = info->flags;
+	unlock_fb_info(info);
+
+	size = (size_t)tmp->fix.line_length * tmp->var.yres;
+	a = vzalloc(size);
+	b = vzalloc(size);
+	if (!a || !b) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	seq_printf(m, "%ux%u %u bpp, ns per fill\n", tmp->var.xres, tmp->var.yres,
+		   tmp->var.bits_per_pixel);
+	seq_printf(m, "%-12s %12s %12s %10s\n", "rect", "sys_fillrect", "vfb", "");
+
+	for (i = 0; i < 3; i++) {
+		struct fb_fillrect rect = { .color = 1, .rop = ROP_COPY };
+		unsigned int loops;
+		u64 t_sys, t_vfb;
+
+		switch (i) {
+		case 0:
+			rect.width = tmp->var.xres;
+			rect.height = tmp->var.yres;
+			break;
+		case 1:
+			rect.width = min_t(u32, 256, tmp->var.xres);
+			rect.height = min_t(u32, 256, tmp->var.yres);
+			break;
+		case 2:
+			rect.width = min_t(u32, 8, tmp->var.xres);
+			rect.height = min_t(u32, 16, tmp->var.yres);
+			break;
+		}
+		rect.dx = tmp->var.xres - rect.width;	/* odd offsets at 24 bpp */
+
+		loops = clamp_t(u64, div_u64(SZ_256M, (u64)rect.width * rect.height *
+					     max(tmp->var.bits_per_pixel / 8, 1u)), 1, 100000);
+
+		tmp->screen_buffer = a;
+		t_sys = vfb_fill_bench_one(tmp, &rect, true, loops);
+		tmp->screen_buffer = b;
+		t_vfb = vfb_fill_bench_one(tmp, &rect, false, loops);
+
+		seq_printf(m, "%5ux%-6u %12llu %12llu %10s\n", rect.width, rect.height,
+			   t_sys, t_vfb, memcmp(a, b, size) ? "MISMATCH" : "same");
+	}
+
+out:
+	vfree(a);
+	vfree(b);
+	framebuffer_release(tmp);
+	return ret;
+}
+DEFINE_SHOW_ATTRIBUTE(vfb_fill_bench);
+
+static void vfb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+	if (!info->screen_buffer)
+		return;
+
+	vfb_snap_break_lines(info, rect->dy, rect->height);
+	if (!vfb_fill(info, rect))
+		sys_fillrect(info, rect);
+	vfb_damage_add(info, rect->dx, rect->dy, rect->width, rect->height);
+}
+
+static void vfb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+	if (!info->screen_buffer)
+		return;
+
+	vfb_snap_break_lines(info, area->dy, area->height);
+	sys_copyarea(info, area);
+	vfb_copy_add(info, area);
+}
+
+static void vfb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	if (!info->screen_buffer)
+		return;
+
+	vfb_snap_break_lines(info, image->dy, image->height);
+	sys_imageblit(info, image);
+	vfb_damage_add(info, image->dx, image->dy, image->width, image->height);
+}
+
+    /*
+     *  Rectangle transfers (VFBIO_READ_RECTS, VFBIO_WRITE_RECTS)
+     *
+     *  Lines are moved between the frame and a bounce buffer, where they
+     *  are packed, page by page like read() and write(), see vfb_mem_rw().
+     *  The byte aligned depths share one path at a byte offset: a copy per
+     *  line, or a single one for whole lines.
+     *  At 1 bpp the lines are shifted to start at the first bit (MSB) of
+     *  a byte, and written back under a mask, read-modify-write of the
+     *  bytes the line touches.
+     */
+
+static size_t vfb_rect_line_bytes(u32 width, u32 bpp)
+{
+	return DIV_ROUND_UP((size_t)width * bpp, 8);
+}
+
+static void vfb_mono_get(u8 *dst, const u8 *src, u32 x, u32 width)
+{
+	unsigned int s = x & 7;
+	size_t n = DIV_ROUND_UP(width, 8);
+	size_t covered = DIV_ROUND_UP(s + width, 8);
+	size_t i;
+
+	src += x / 8;
+	for (i = 0; i < n; i++) {
+		u8 v = src[i] << s;
+
+		if (s && i + 1 < covered)
+			v |= src[i + 1] >> (8 - s);
+		dst[i] = v;
+	}
+	if (width & 7)
+		dst[n - 1] &= 0xff << (8 - (width & 7));
+}
+
+static void vfb_mono_put(u8 *dst, const u8 *src, u32 x, u32 width)
+{
+	unsigned int s = x & 7;
+	size_t n = DIV_ROUND_UP(width, 8);
+	size_t covered = DIV_ROUND_UP(s + width, 8);
+	size_t j;
+
+	dst += x / 8;
+	for (j = 0; j < covered; j++) {
+		/* bits [lo, hi) of this byte belong to the rectangle */
+		unsigned int lo = j ? 0 : s;
+		unsigned int hi = min_t(size_t, s + width - j * 8, 8);
+		u8 m = (0xff >> lo) & (0xff << (8 - hi));
+		u8 v = 0;
+
+		if (j < n)
+			v |= src[j] >> s;
+		if (s && j)
+			v |= src[j - 1] << (8 - s);
+		dst[j] = (dst[j] & ~m) | (v & m);
+	}
+}
+
+    /*
+     *  Move lines y to y + rows - 1 of r between the frame and buf, where
+     *  they are packed. line is room for one line of r plus a byte.
+     */
+
+static int vfb_rect_rw(struct fb_info *info, u8 *buf, u8 *line, const struct vfb_rect *r,
+		       u32 y, u32 rows, bool write)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 line_length = info->fix.line_length;
+	size_t len = vfb_rect_line_bytes(r->width, bpp);
+	/* the bytes a 1 bpp line touches, it starts at bit r->x & 7 */
+	size_t span = vfb_rect_line_bytes((r->x & 7) + r->width, 1);
+	loff_t pos = (loff_t)y * line_length + (size_t)r->x * bpp / 8;
+	u32 i;
+	int ret;
+
+	if (bpp != 1 && len == line_length)
+		return vfb_mem_rw(info, buf, len * rows, pos, write);
+
+	for (i = 0; i < rows; i++, buf += len, pos += line_length) {
+		if (bpp != 1) {
+			ret = vfb_mem_rw(info, buf, len, pos, write);
+		} else {
+			ret = vfb_mem_rw(info, line, span, pos, false);
+			if (!ret && write) {
+				vfb_mono_put(line, buf, r->x & 7, r->width);
+				ret = vfb_mem_rw(info, line, span, pos, true);
+			} else if (!ret) {
+				vfb_mono_get(buf, line, r->x & 7, r->width);
+			}
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int vfb_rows_to_user(u8 __user *dst, size_t pitch, const u8 *src, size_t len, u32 rows)
+{
+	if (pitch == len)
+		return copy_to_user(dst, src, len * rows) ? -EFAULT : 0;
+
+	while (rows--) {
+		if (copy_to_user(dst, src, len))
+			return -EFAULT;
+		dst += pitch;
+		src += len;
+	}
+	return 0;
+}
+
+static int vfb_rows_from_user(u8 *dst, const u8 __user *src, size_t pitch, size_t len, u32 rows)
+{
+	if (pitch == len)
+		return copy_from_user(dst, src, len * rows) ? -EFAULT : 0;
+
+	while (rows--) {
+		if (copy_from_user(dst, src, len))
+			return -EFAULT;
+		dst += len;
+		src += pitch;
+	}
+	return 0;
+}
+
+    /*
+     *  Frame CRCs, modelled on the DRM CRC API
+     *
+     *  debugfs vfb/fbN/crc/control selects the source: "auto" for the
+     *  visible frame, or "x y width height" for a rectangle of it. While
+     *  crc/data is open a CRC32 of the source is computed on every pan and
+     *  once per frame of the mode, and read from crc/data as lines of
+     *  vblank count and CRC. At most VFB_CRC_ENTRIES are kept, CRCs that
+     *  find the FIFO full are dropped. Only one reader at a time.
+     */
+
+static struct vfb_crc *vfb_crc_alloc(void)
+{
+	struct vfb_crc *crc;
+
+	crc = kzalloc(sizeof(*crc), GFP_KERNEL);
+	if (!crc)
+		return NULL;
+
+	kref_init(&crc->kref);
+	spin_lock_init(&crc->lock);
+	INIT_KFIFO(crc->fifo);
+	init_waitqueue_head(&crc->wait);
+	return crc;
+}
+
+static void vfb_crc_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct vfb_crc, kref));
+}
+
+static void vfb_crc_work(struct work_struct *work)
+{
+	struct vfb_par *par = container_of(to_delayed_work(work), struct vfb_par, crc_work);
+	struct vfb_crc *crc = par->crc;
+	struct fb_info *info = par->info;
+	/* may change under us, the CRC only has to stay in bounds */
+	struct fb_var_screeninfo var = info->var;
+	size_t line_length = info->fix.line_length;
+	struct vfb_rect visible = { 0, 0, var.xres, var.yres };
+	struct vfb_crc_entry entry;
+	struct vfb_rect src;
+	size_t first, len;
+	bool ok = false;
+	u32 y, row, c = 0;
+	u8 *line;
+
+	vfb_front(par, &var);
+
+	spin_lock(&crc->lock);
+	src = crc->source;
+	if (!crc->opened) {
+		spin_unlock(&crc->lock);
+		return;
+	}
+	spin_unlock(&crc->lock);
+
+	if (!src.width)
+		src = visible;
+	if (!vfb_rect_intersect(&src, &visible))
+		memset(&src, 0, sizeof(src));
+
+	first = (size_t)(var.xoffset + src.x) * var.bits_per_pixel / 8;
+	len = vfb_rect_line_bytes(src.width, var.bits_per_pixel);
+
+	/* copied line by line like read(), nothing stays mapped or allocated */
+	line = kvmalloc(max_t(size_t, len, 1), GFP_KERNEL);
+	if (line && var.yres <= var.yres_virtual && var.yoffset < var.yres_virtual &&
+	    (u64)(var.yres_virtual - 1) * line_length + first + len <=
+	    (u64)vfb_npages(par) << PAGE_SHIFT) {
+		ok = true;
+		for (y = 0; y < src.height && ok; y++) {
+			row = var.yoffset + src.y + y;
+			if (row >= var.yres_virtual)
+				row -= var.yres_virtual;	/* FB_VMODE_YWRAP */
+			ok = !vfb_mem_rw(info, line, len, (loff_t)row * line_length + first, false);
+			c = crc32_le(c, line, len);
+		}
+	}
+	kvfree(line);
+
+	if (ok) {
+		spin_lock(&crc->lock);
+		entry.frame = vfb_vblank_count(par, NULL);
+		entry.crc = c;
+		if (!kfifo_put(&crc->fifo, entry) && !crc->overflow) {
+			crc->overflow = true;
+			fb_warn(info, "CRC FIFO overflow, reader too slow\n");
+		}
+		spin_unlock(&crc->lock);
+		wake_up_interruptible(&crc->wait);
+	}
+
+	queue_delayed_work(system_wq, &par->crc_work,
+			   max_t(unsigned long, nsecs_to_jiffies(vfb_frame_ns(&var)), 1));
+}
+
+static int vfb_crc_control_show(struct seq_file *m, void *unused)
+{
+	struct vfb_par *par = m->private;
+	struct vfb_rect src;
+
+	spin_lock(&par->crc->lock);
+	src = par->crc->source;
+	spin_unlock(&par->crc->lock);
+
+	if (!src.width)
+		seq_puts(m, "auto\n");
+	else
+		seq_printf(m, "%u %u %u %u\n", src.x, src.y, src.width, src.height);
+	return 0;
+}
+
+static int vfb_crc_control_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vfb_crc_control_show, inode->i_private);
+}
+
+static ssize_t vfb_crc_control_write(struct file *file, const char __user *ubuf,
+				     size_t len, loff_t *offp)
+{
+	struct vfb_par *par = ((struct seq_file *)file->private_data)->private;
+	struct vfb_rect src = { 0 };
+	char buf[64];
+	int ret = 0;
+
+	if (len >= sizeof(buf))
+		return -E2BIG;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = 0;
+
+	if (!sysfs_streq(buf, "auto") &&
+	    (sscanf(buf, "%u %u %u %u", &src.x, &src.y, &src.width, &src.height) != 4 ||
+	     !src.width || !src.height))
+		return -EINVAL;
+
+	spin_lock(&par->crc->lock);
+	if (par->crc->opened)
+		ret = -EBUSY;
+	else
+		par->crc->source = src;
+	spin_unlock(&par->crc->lock);
+
+	return ret ? ret : len;
+}
+
+static const struct file_operations vfb_crc_control_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vfb_crc_control_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= vfb_crc_control_write,
+};
+
+#define VFB_CRC_LINE_LEN	30	/* "0x%016llx 0x%08x\n" */
+
+static int vfb_crc_data_open(struct inode *inode, struct file *file)
+{
+	struct vfb_par *par = inode->i_private;
+	struct vfb_crc *crc = par->crc;
+
+	spin_lock(&crc->lock);
+	if (crc->opened) {
+		spin_unlock(&crc->lock);
+		return -EBUSY;
+	}
+	crc->opened = true;
+	crc->overflow = false;
+	kfifo_reset(&crc->fifo);
+	spin_unlock(&crc->lock);
+
+	/* the release may come after the device is gone */
+	kref_get(&crc->kref);
+	file->private_data = crc;
+	mod_delayed_work(system_wq, &par->crc_work, 0);
+	return 0;
+}
+
+static bool vfb_crc_ready(struct vfb_crc *crc)
+{
+	bool ready;
+
+	spin_lock(&crc->lock);
+	ready = !kfifo_is_empty(&crc->fifo);
+	spin_unlock(&crc->lock);
+	return ready;
+}
+
+static ssize_t vfb_crc_data_read(struct file *file, char __user *ubuf,
+				 size_t count, loff_t *pos)
+{
+	struct vfb_crc *crc = file->private_data;
+	char buf[VFB_CRC_LINE_LEN + 1];
+	struct vfb_crc_entry entry;
+	ssize_t ret = 0;
+	int err;
+
+	if (count < VFB_CRC_LINE_LEN)
+		return -EINVAL;
+
+	if (!vfb_crc_ready(crc)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		err = wait_event_interruptible(crc->wait, vfb_crc_ready(crc));
+		if (err)
+			return err;
+	}
+
+	while (count - ret >= VFB_CRC_LINE_LEN) {
+		spin_lock(&crc->lock);
+		if (!kfifo_get(&crc->fifo, &entry)) {
+			spin_unlock(&crc->lock);
+			break;
+		}
+		spin_unlock(&crc->lock);
+
+		snprintf(buf, sizeof(buf), "0x%016llx 0x%08x\n", entry.frame, entry.crc);
+		if (copy_to_user(ubuf + ret, buf, VFB_CRC_LINE_LEN))
+			return ret ? ret : -EFAULT;
+		ret += VFB_CRC_LINE_LEN;
+	}
+
+	return ret;
+}
+
+static __poll_t vfb_crc_data_poll(struct file *file, poll_table *wait)
+{
+	struct vfb_crc *crc = file->private_data;
+
+	poll_wait(file, &crc->wait, wait);
+
+	return vfb_crc_ready(crc) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int vfb_crc_data_release(struct inode *inode, struct file *file)
+{
+	struct vfb_crc *crc = file->private_data;
+
+	/* the work item stops on its next run */
+	spin_lock(&crc->lock);
+	crc->opened = false;
+	spin_unlock(&crc->lock);
+
+	kref_put(&crc->kref, vfb_crc_free);
+	return 0;
+}
+
+static const struct file_operations vfb_crc_data_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vfb_crc_data_open,
+	.read		= vfb_crc_data_read,
+	.poll		= vfb_crc_data_poll,
+	.release	= vfb_crc_data_release,
+	.llseek		= no_llseek,
+};
+
+    /*
+     *  debugfs vfb/fbN/latency: flip and present latency, writing to it
+     *  starts over.
+     */
+
+static void vfb_latency_show_hist(struct seq_file *m, const char *name,
+				  const struct vfb_hist *h)
+{
+	seq_printf(m, "%s: count %llu p50 %lluus p99 %lluus max %lluus\n", name, h->count,
+		   div_u64(vfb_hist_percentile(h, 50), NSEC_PER_USEC),
+		   div_u64(vfb_hist_percentile(h, 99), NSEC_PER_USEC),
+		   div_u64(h->max, NSEC_PER_USEC));
+}
+
+static int vfb_latency_show(struct seq_file *m, void *unused)
+{
+	struct vfb_par *par = m->private;
+	struct vfb_flip_stats *stats;
+	unsigned long flags;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&par->vblank.lock, flags);
+	*stats = par->vblank.stats;
+	spin_unlock_irqrestore(&par->vblank.lock, flags);
+
+	seq_printf(m, "flips: %llu\n", stats->flips);
+	seq_printf(m, "missed vblanks: %llu\n", stats->missed);
+	vfb_latency_show_hist(m, "pan to latch", &stats->latch);
+	vfb_latency_show_hist(m, "latch to ack", &stats->ack);
+	vfb_latency_show_hist(m, "pan to ack", &stats->total);
+
+	kfree(stats);
+	return 0;
+}
+
+static int vfb_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vfb_latency_show, inode->i_private);
+}
+
+static ssize_t vfb_latency_write(struct file *file, const char __user *ubuf,
+				 size_t len, loff_t *offp)
+{
+	struct vfb_par *par = ((struct seq_file *)file->private_data)->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->vblank.lock, flags);
+	memset(&par->vblank.stats, 0, sizeof(par->vblank.stats));
+	spin_unlock_irqrestore(&par->vblank.lock, flags);
+
+	return len;
+}
+
+static const struct file_operations vfb_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vfb_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= vfb_latency_write,
+};
+
+static void vfb_debugfs_init(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+	struct dentry *dir;
+
+	par->debugfs = debugfs_create_dir(dev_name(info->dev), vfb_debugfs_root);
+	dir = debugfs_create_dir("crc", par->debugfs);
+	debugfs_create_file("control", S_IRUGO | S_IWUSR, dir, par, &vfb_crc_control_fops);
+	debugfs_create_file("data", S_IRUGO, dir, par, &vfb_crc_data_fops);
+	debugfs_create_file("latency", S_IRUGO | S_IWUSR, par->debugfs, par, &vfb_latency_fops);
+	debugfs_create_file("fillrect_bench", S_IRUSR, par->debugfs, info, &vfb_fill_bench_fops);
+}
+
+    /*
+     *  Data fd (VFBIO_GET_DATA_FD)
+     *
+     *  An fd of its own for the video memory, with read_iter/write_iter,
+     *  so it works with splice, sendfile and io_uring, which /dev/fbN
+     *  doesn't do. It reaches the device through a refcounted link that
+     *  the device cuts when it goes away, after which reads return EOF.
+     */
+
+struct vfb_link {
+	struct kref kref;
+	struct rw_semaphore sem;
+	struct fb_info *info;		/* NULL once the device is gone */
+};
+
+static struct vfb_link *vfb_link_alloc(struct fb_info *info)
+{
+	struct vfb_link *link;
+
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link)
+		return NULL;
+
+	kref_init(&link->kref);
+	init_rwsem(&link->sem);
+	link->info = info;
+	return link;
+}
+
+static void vfb_link_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct vfb_link, kref));
+}
+
+static void vfb_link_cut(struct vfb_link *link)
+{
+	down_write(&link->sem);
+	link->info = NULL;
+	up_write(&link->sem);
+	kref_put(&link->kref, vfb_link_free);
+}
+
+static ssize_t vfb_data_rw_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct vfb_link *link = iocb->ki_filp->private_data;
+	bool write = iov_iter_rw(iter) == WRITE;
+	u64 size;
+	ssize_t ret;
+
+	down_read(&link->sem);
+	if (!link->info) {
+		ret = write ? -ENODEV : 0;
+		goto out;
+	}
+
+	size = (u64)vfb_npages(link->info->par) << PAGE_SHIFT;
+	if (iocb->ki_pos >= size) {
+		ret = write && iov_iter_count(iter) ? -ENOSPC : 0;
+		goto out;
+	}
+
+	iov_iter_truncate(iter, size - iocb->ki_pos);
+	ret = vfb_rw_iter(link->info, iter, &iocb->ki_pos);
+out:
+	up_read(&link->sem);
+	return ret;
+}
+
+    /*
+     *  Pages of the array go into the pipe by reference. Not through
+     *  copy_page_to_iter(), whose page cache buffer ops fail to confirm
+     *  pages without a mapping that aren't uptodate, which is all of ours.
+     *  Holes, shmem and dma-buf memory are copied into a page of its own.
+     */
+
+static const struct pipe_buf_operations vfb_pipe_buf_ops = {
+	.release	= generic_pipe_buf_release,
+	.get		= generic_pipe_buf_get,
+};
+
+static ssize_t vfb_data_splice_page(struct fb_info *info, struct pipe_inode_info *pipe,
+				    loff_t pos, size_t len)
+{
+	struct pipe_buffer buf = {
+		.ops	= &vfb_pipe_buf_ops,
+		.offset	= offset_in_page(pos),
+		.len	= min_t(size_t, len, PAGE_SIZE - offset_in_page(pos)),
+	};
+	struct bio_vec bvec;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	buf.page = vfb_get_page(info->par, pos >> PAGE_SHIFT, false, NULL);
+	if (!buf.page) {
+		buf.page = alloc_page(GFP_KERNEL);
+		if (!buf.page)
+			return -ENOMEM;
+
+		bvec.bv_page = buf.page;
+		bvec.bv_offset = buf.offset;
+		bvec.bv_len = buf.len;
+		iov_iter_bvec(&iter, ITER_DEST, &bvec, 1, buf.len);
+		ret = vfb_rw_iter(info, &iter, &pos);
+		if (ret <= 0) {
+			put_page(buf.page);
+			return ret;
+		}
+		buf.len = ret;
+	}
+
+	/* releases buf on failure */
+	return add_to_pipe(pipe, &buf);
+}
+
+static ssize_t vfb_data_splice_read(struct file *file, loff_t *ppos,
+				    struct pipe_inode_info *pipe, size_t len,
+				    unsigned int flags)
+{
+	struct vfb_link *link = file->private_data;
+	ssize_t ret = 0;
+	u64 size;
+
+	down_read(&link->sem);
+	if (!link->info)
+		goto out;
+
+	size = (u64)vfb_npages(link->info->par) << PAGE_SHIFT;
+	if (*ppos >= size)
+		goto out;
+	len = min_t(u64, len, size - *ppos);
+
+	while (len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+		ssize_t n = vfb_data_splice_page(link->info, pipe, *ppos, len);
+
+		if (n <= 0) {
+			if (!ret)
+				ret = n;
+			break;
+		}
+		*ppos += n;
+		len -= n;
+		ret += n;
+	}
+out:
+	up_read(&link->sem);
+	return ret;
+}
+
+static loff_t vfb_data_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct vfb_link *link = file->private_data;
+	loff_t size = 0;
+
+	down_read(&link->sem);
+	if (link->info)
+		size = (loff_t)vfb_npages(link->info->par) << PAGE_SHIFT;
+	up_read(&link->sem);
+
+	return fixed_size_llseek(file, offset, whence, size);
+}
+
+static int vfb_data_release(struct inode *inode, struct file *file)
+{
+	struct vfb_link *link = file->private_data;
+
+	kref_put(&link->kref, vfb_link_free);
+	return 0;
+}
+
+static const struct file_operations vfb_data_fops = {
+	.owner		= THIS_MODULE,
+	.read_iter	= vfb_data_rw_iter,
+	.write_iter	= vfb_data_rw_iter,
+	.splice_read	= vfb_data_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.llseek		= vfb_data_llseek,
+	.release	= vfb_data_release,
+};
+
+    /*
+     *  Driver specific ioctls, see vfb.h
+     */
+
+static int vfb_ioctl_get_memfd(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_memfd memfd;
+	struct file *shmem;
+	int fd;
+
+	if (copy_from_user(&memfd, argp, sizeof(memfd)))
+		return -EFAULT;
+
+	if (memfd.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	shmem = vfb_get_shmem(par);
+	if (!shmem)
+		return -EOPNOTSUPP;
+
+	fd = get_unused_fd_flags(memfd.flags);
+	if (fd < 0) {
+		fput(shmem);
+		return fd;
+	}
+
+	memfd.fd = fd;
+	if (copy_to_user(argp, &memfd, sizeof(memfd))) {
+		put_unused_fd(fd);
+		fput(shmem);
+		return -EFAULT;
+	}
+
+	fd_install(fd, shmem);
+	return 0;
+}
+
+    /*
+     *  dma-buf export
+     *
+     *  An exported buffer holds a reference to every page the device had
+     *  at export time, so it stays valid, and keeps showing that memory,
+     *  when a mode change later replaces the backing store. Lazy buffers
+     *  are fully backed on export. The pages are ordinary cached memory:
+     *  the CPU access brackets only sync the device mappings of importers.
+     */
+
+struct vfb_dmabuf {
+	struct mutex lock;		/* protects attachments */
+	struct list_head attachments;
+	bool shmem;			/* pages belong to a shmem file */
+	unsigned long npages;
+	struct page *pages[];
+};
+
+struct vfb_dmabuf_attachment {
+	struct list_head list;
+	struct device *dev;
+	struct sg_table *sgt;		/* while mapped */
+	enum dma_data_direction dir;
+};
+
+static void vfb_dmabuf_free(struct vfb_dmabuf *buf)
+{
+	unsigned long i;
+
+	for (i = 0; i < buf->npages; i++) {
+		/* may have been written through the export */
+		if (buf->shmem)
+			set_page_dirty_lock(buf->pages[i]);
+		put_page(buf->pages[i]);
+	}
+	kvfree(buf);
+}
+
+static struct vfb_dmabuf *vfb_dmabuf_alloc(struct vfb_par *par)
+{
+	struct vfb_mem *mem;
+	struct vfb_dmabuf *buf;
+	struct page *page;
+	unsigned long i;
+	int ret = -ENOMEM;
+
+	mutex_lock(&par->lock);
+	mem = par->mem;
+
+	buf = kvzalloc(struct_size(buf, pages, mem->npages), GFP_KERNEL);
+	if (!buf)
+		goto err;
+
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+	buf->shmem = mem->alloc == VFB_ALLOC_SHMEM;
+
+	for (i = 0; i < mem->npages; i++) {
+		if (buf->shmem) {
+			page = shmem_read_mapping_page(mem->shmem->f_mapping, i);
+			if (IS_ERR(page)) {
+				ret = PTR_ERR(page);
+				goto err1;
+			}
+		} else {
+			page = mem->pages[i];
+			if (!page)
+				page = mem->pages[i] = vfb_mem_alloc_page(mem);
+			if (!page)
+				goto err1;
+			get_page(page);
+		}
+		buf->pages[buf->npages++] = page;
+	}
+	mutex_unlock(&par->lock);
+
+	return buf;
+err1:
+	vfb_dmabuf_free(buf);
+err:
+	mutex_unlock(&par->lock);
+	return ERR_PTR(ret);
+}
+
+static int vfb_dmabuf_attach(struct dma_buf *dmabuf,
+			     struct dma_buf_attachment *attach)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+	struct vfb_dmabuf_attachment *a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->list, &buf->attachments);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static void vfb_dmabuf_detach(struct dma_buf *dmabuf,
+			      struct dma_buf_attachment *attach)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+	struct vfb_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->list);
+	mutex_unlock(&buf->lock);
+
+	kfree(a);
+}
+
+static struct sg_table *vfb_dmabuf_map(struct dma_buf_attachment *attach,
+				       enum dma_data_direction dir)
+{
+	struct vfb_dmabuf *buf = attach->dmabuf->priv;
+	struct vfb_dmabuf_attachment *a = attach->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, buf->pages, buf->npages, 0,
+					buf->npages << PAGE_SHIFT, GFP_KERNEL);
+	if (ret)
+		goto err;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto err1;
+
+	mutex_lock(&buf->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+
+	return sgt;
+err1:
+	sg_free_table(sgt);
+err:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void vfb_dmabuf_unmap(struct dma_buf_attachment *attach,
+			     struct sg_table *sgt, enum dma_data_direction dir)
+{
+	struct vfb_dmabuf *buf = attach->dmabuf->priv;
+	struct vfb_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->sgt = NULL;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int vfb_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+				       enum dma_data_direction dir)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+	struct vfb_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, list)
+		if (a->sgt)
+			dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int vfb_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+				     enum dma_data_direction dir)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+	struct vfb_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, list)
+		if (a->sgt)
+			dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int vfb_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+
+	return vm_map_pages(vma, buf->pages, buf->npages);
+}
+
+static int vfb_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct vfb_dmabuf *buf = dmabuf->priv;
+	void *vaddr;
+
+	/* the core counts the users, this runs for the first one only */
+	vaddr = vmap(buf->pages, buf->npages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr)
+		return -ENOMEM;
+
+	iosys_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void vfb_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	vunmap(map->vaddr);
+}
+
+static void vfb_dmabuf_release(struct dma_buf *dmabuf)
+{
+	vfb_dmabuf_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops vfb_dmabuf_ops = {
+	.attach			= vfb_dmabuf_attach,
+	.detach			= vfb_dmabuf_detach,
+	.map_dma_buf		= vfb_dmabuf_map,
+	.unmap_dma_buf		= vfb_dmabuf_unmap,
+	.begin_cpu_access	= vfb_dmabuf_begin_cpu_access,
+	.end_cpu_access		= vfb_dmabuf_end_cpu_access,
+	.mmap			= vfb_dmabuf_mmap,
+	.vmap			= vfb_dmabuf_vmap,
+	.vunmap			= vfb_dmabuf_vunmap,
+	.release		= vfb_dmabuf_release,
+};
+
+static int vfb_ioctl_export_dmabuf(struct fb_info *info, void __user *argp)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct vfb_export_dmabuf exp;
+	struct vfb_dmabuf *buf;
+	struct dma_buf *dmabuf;
+	int fd;
+
+	if (copy_from_user(&exp, argp, sizeof(exp)))
+		return -EFAULT;
+
+	if (exp.flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+
+	/* an imported dma-buf is handed out again */
+	dmabuf = vfb_get_dmabuf(info->par);
+	if (!dmabuf) {
+		buf = vfb_dmabuf_alloc(info->par);
+		if (IS_ERR(buf))
+			return PTR_ERR(buf);
+
+		exp_info.ops = &vfb_dmabuf_ops;
+		exp_info.size = buf->npages << PAGE_SHIFT;
+		exp_info.flags = exp.flags & O_ACCMODE;
+		exp_info.priv = buf;
+
+		dmabuf = dma_buf_export(&exp_info);
+		if (IS_ERR(dmabuf)) {
+			vfb_dmabuf_free(buf);
+			return PTR_ERR(dmabuf);
+		}
+	}
+
+	/* dma_buf_put() releases buf from here on */
+	fd = get_unused_fd_flags(exp.flags & O_CLOEXEC);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	exp.fd = fd;
+	exp.size = dmabuf->size;
+	if (copy_to_user(argp, &exp, sizeof(exp))) {
+		put_unused_fd(fd);
+		dma_buf_put(dmabuf);
+		return -EFAULT;
+	}
+
+	fd_install(fd, dmabuf->file);
+	return 0;
+}
+
+    /*
+     *  Collect the dirty pages as full width bands of lines of the virtual
+     *  screen, merging adjacent ones. If there are more bands than room,
+     *  the last rectangle is stretched over the rest.
+     */
+
+static int vfb_ioctl_get_dirty(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	u32 line_length = info->fix.line_length;
+	u32 yres = info->var.yres_virtual;
+	struct vfb_dirty dirty;
+	struct vfb_rect *rects, *r;
+	unsigned long start, end;
+	u32 nr, n = 0;
+	int ret = 0;
+
+	if (copy_from_user(&dirty, argp, sizeof(dirty)))
+		return -EFAULT;
+
+	if (dirty.flags || !dirty.nr_rects)
+		return -EINVAL;
+
+	if (!par->dirty)
+		return -EOPNOTSUPP;
+
+	nr = min(dirty.nr_rects, yres);
+	rects = kvmalloc_array(nr, sizeof(*rects), GFP_KERNEL);
+	if (!rects)
+		return -ENOMEM;
+
+	mutex_lock(&par->lock);
+	if (par->mem->alloc == VFB_ALLOC_SHMEM || par->mem->alloc == VFB_ALLOC_DMABUF) {
+		/* mapped through the file or dma-buf, not tracked */
+		mutex_unlock(&par->lock);
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	for_each_set_bitrange(start, end, par->dirty,
+			      min(par->mem->npages, par->dirty_npages)) {
+		u64 first = (u64)start << PAGE_SHIFT;
+		u64 len = (u64)(end - start) << PAGE_SHIFT;
+		u32 y0 = div_u64(first, line_length);
+		u32 y1 = min_t(u64, div_u64(first + len - 1, line_length), yres - 1);
+
+		bitmap_clear(par->dirty, start, end - start);
+		if (par->mapping)
+			unmap_mapping_range(par->mapping, first, len, 0);
+
+		if (y0 >= yres)
+			continue;
+
+		r = n ? &rects[n - 1] : NULL;
+		if (r && (y0 <= r->y + r->height || n == nr)) {
+			r->height = max(r->y + r->height, y1 + 1) - r->y;
+			continue;
+		}
+
+		r = &rects[n++];
+		r->x = 0;
+		r->y = y0;
+		r->width = info->var.xres_virtual;
+		r->height = y1 - y0 + 1;
+	}
+	mutex_unlock(&par->lock);
+
+	if (copy_to_user(u64_to_user_ptr(dirty.rects), rects, n * sizeof(*rects))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	dirty.nr_rects = n;
+	if (copy_to_user(argp, &dirty, sizeof(dirty)))
+		ret = -EFAULT;
+out:
+	kvfree(rects);
+	return ret;
+}
+
+static int vfb_ioctl_damage(struct fb_info *info, void __user *argp)
+{
+	struct vfb_damage damage;
+	struct vfb_rect *rects;
+	u32 i;
+
+	if (copy_from_user(&damage, argp, sizeof(damage)))
+		return -EFAULT;
+
+	if (damage.flags)
+		return -EINVAL;
+
+	/* like FB_DAMAGE_CLIPS, no clips means everything */
+	if (!damage.nr_rects) {
+		vfb_damage_add(info, 0, 0, info->var.xres_virtual, info->var.yres_virtual);
+		return 0;
+	}
+
+	if (damage.nr_rects > VFB_DAMAGE_MAX_CLIPS)
+		return -E2BIG;
+
+	rects = vmemdup_user(u64_to_user_ptr(damage.rects),
+			     array_size(damage.nr_rects, sizeof(*rects)));
+	if (IS_ERR(rects))
+		return PTR_ERR(rects);
+
+	for (i = 0; i < damage.nr_rects; i++)
+		vfb_damage_add(info, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+
+	kvfree(rects);
+	return 0;
+}
+
+static int vfb_ioctl_get_damage(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_rect rects[VFB_DAMAGE_RECTS];
+	struct vfb_damage damage;
+	unsigned long flags;
+	unsigned int i, n;
+
+	if (copy_from_user(&damage, argp, sizeof(damage)))
+		return -EFAULT;
+
+	if (damage.flags || !damage.nr_rects)
+		return -EINVAL;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	/* this caller doesn't replay copies */
+	vfb_copies_fold(par->copies, &par->nr_copies, par->damage, &par->nr_damage);
+	n = par->nr_damage;
+	memcpy(rects, par->damage, n * sizeof(*rects));
+	par->nr_damage = 0;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	/* no room for all, hand out the bounding box */
+	if (n > damage.nr_rects) {
+		for (i = 1; i < n; i++)
+			vfb_rect_union(&rects[0], &rects[i]);
+		n = 1;
+	}
+
+	damage.nr_rects = n;
+	if (copy_to_user(u64_to_user_ptr(damage.rects), rects, n * sizeof(*rects)) ||
+	    copy_to_user(argp, &damage, sizeof(damage))) {
+		/* taken, but not handed out */
+		vfb_damage_restore(par, NULL, 0, rects, n);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+    /*
+     *  Hash the frame and compare it with the previous detection. The
+     *  first one after a mode change reports everything.
+     */
+
+static int vfb_update_detect(struct fb_info *info, struct vfb_motion_result *res)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_motion *old = &par->motion;
+	struct vfb_motion new = { 0 };
+	struct vfb_motion_key *keys = NULL;
+	u32 *votes = NULL;
+	u32 n;
+	int ret;
+
+	ret = vfb_motion_alloc(&new, info->var.xres_virtual, info->var.yres_virtual,
+			       info->var.bits_per_pixel >= 8);
+	if (ret)
+		return ret;
+
+	ret = vfb_map_kernel(info);
+	if (ret)
+		goto out;
+	vfb_motion_hash(info, &new);
+	vfb_unmap_kernel(info);
+
+	if (!old->rows || old->width != new.width || old->height != new.height ||
+	    !old->cols != !new.cols) {
+		vfb_rects_add(res->rects, &res->nr_rects, VFB_DAMAGE_RECTS,
+			      (struct vfb_rect){ 0, 0, new.width, new.height });
+	} else {
+		n = max(new.width, new.height);
+		keys = kvmalloc_array(n, sizeof(*keys), GFP_KERNEL);
+		votes = kvmalloc_array(2 * n, sizeof(*votes), GFP_KERNEL);
+		if (!keys || !votes) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		vfb_motion_detect(old, &new, res, keys, votes);
+	}
+
+	vfb_motion_free(old);
+	*old = new;
+	new.rows = NULL;
+	new.cols = NULL;
+out:
+	kvfree(votes);
+	kvfree(keys);
+	vfb_motion_free(&new);
+	return ret;
+}
+
+    /*
+     *  The detected copies cover the whole change since the previous
+     *  detection, the recorded ones included, so those aren't replayed a
+     *  second time: a recorded copy that was found again is dropped, any
+     *  other is turned into damage. The recorded damage is kept, on top
+     *  of the detected one.
+     */
+
+static int vfb_update_detect_merge(struct fb_info *info, struct vfb_motion_result *res)
+{
+	struct vfb_motion_result *det;
+	unsigned int i, j;
+	int ret;
+
+	det = kzalloc(sizeof(*det), GFP_KERNEL);
+	if (!det)
+		return -ENOMEM;
+
+	ret = vfb_update_detect(info, det);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < res->nr_copies; i++) {
+		for (j = 0; j < det->nr_copies; j++)
+			if (!memcmp(&res->copies[i], &det->copies[j], sizeof(det->copies[j])))
+				break;
+		if (j == det->nr_copies)
+			vfb_rects_add(det->rects, &det->nr_rects, VFB_DAMAGE_RECTS,
+				      res->copies[i].dst);
+	}
+	for (i = 0; i < res->nr_rects; i++)
+		vfb_rects_add(det->rects, &det->nr_rects, VFB_DAMAGE_RECTS, res->rects[i]);
+
+	*res = *det;
+out:
+	kfree(det);
+	return ret;
+}
+
+static int vfb_ioctl_get_update(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_motion_result *res;
+	struct vfb_update update;
+	unsigned long flags;
+	unsigned int i;
+	int ret = 0;
+
+	if (copy_from_user(&update, argp, sizeof(update)))
+		return -EFAULT;
+
+	if ((update.flags & ~VFB_UPDATE_DETECT) || update.reserved || !update.nr_rects)
+		return -EINVAL;
+
+	res = kzalloc(sizeof(*res), GFP_KERNEL);
+	if (!res)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	res->nr_copies = par->nr_copies;
+	memcpy(res->copies, par->copies, par->nr_copies * sizeof(*res->copies));
+	res->nr_rects = par->nr_damage;
+	memcpy(res->rects, par->damage, par->nr_damage * sizeof(*res->rects));
+	par->nr_copies = 0;
+	par->nr_damage = 0;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	if (update.flags & VFB_UPDATE_DETECT) {
+		ret = vfb_update_detect_merge(info, res);
+		if (ret) {
+			vfb_damage_restore(par, res->copies, res->nr_copies,
+					   res->rects, res->nr_rects);
+			goto out;
+		}
+	}
+
+	if (res->nr_copies > update.nr_copies)
+		vfb_copies_fold(res->copies, &res->nr_copies, res->rects, &res->nr_rects);
+
+	/* no room for all, hand out the bounding box */
+	if (res->nr_rects > update.nr_rects) {
+		for (i = 1; i < res->nr_rects; i++)
+			vfb_rect_union(&res->rects[0], &res->rects[i]);
+		res->nr_rects = 1;
+	}
+
+	update.nr_copies = res->nr_copies;
+	update.nr_rects = res->nr_rects;
+	if (copy_to_user(u64_to_user_ptr(update.copies), res->copies,
+			 res->nr_copies * sizeof(*res->copies)) ||
+	    copy_to_user(u64_to_user_ptr(update.rects), res->rects,
+			 res->nr_rects * sizeof(*res->rects)) ||
+	    copy_to_user(argp, &update, sizeof(update))) {
+		/* taken, but not handed out */
+		vfb_damage_restore(par, res->copies, res->nr_copies,
+				   res->rects, res->nr_rects);
+		ret = -EFAULT;
+	}
+out:
+	kfree(res);
+	return ret;
+}
+
+static int vfb_ioctl_get_event_fd(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_events *hub = par->events;
+	struct vfb_event_fd req;
+	struct vfb_listener *l;
+	struct file *file;
+	int fd;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.events || (req.events & ~VFB_EVENT_ALL) ||
+	    (req.flags & ~(O_CLOEXEC | O_NONBLOCK)) || req.reserved)
+		return -EINVAL;
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!l)
+		return -ENOMEM;
+
+	l->hub = hub;
+	l->mask = req.events;
+	kref_get(&hub->kref);
+
+	spin_lock_irq(&hub->lock);
+	list_add_tail(&l->list, &hub->listeners);
+	spin_unlock_irq(&hub->lock);
+
+	file = anon_inode_getfile("[vfb_events]", &vfb_events_fops, l,
+				  O_RDONLY | (req.flags & O_NONBLOCK));
+	if (IS_ERR(file)) {
+		vfb_listener_free(l);
+		return PTR_ERR(file);
+	}
+
+	/* l is released with the file from here on */
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		return fd;
+	}
+
+	req.fd = fd;
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		fput(file);
+		return -EFAULT;
+	}
+
+	fd_install(fd, file);
+	return 0;
+}
+
+static int vfb_ioctl_get_tiles(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_tile_grid *grid;
+	struct vfb_tiles tiles;
+	unsigned long *bitmap;
+	u64 *words;
+	size_t i, n;
+	int ret;
+
+	if (copy_from_user(&tiles, argp, sizeof(tiles)))
+		return -EFAULT;
+
+	/* the whole buffer gets hashed, so it has to be backed and mapped */
+	ret = vfb_map_kernel(info);
+	if (ret)
+		return ret;
+
+	ret = vfb_tiles_update(info);
+	vfb_unmap_kernel(info);
+	if (ret)
+		return ret;
+
+	grid = par->tiles;
+	n = (size_t)grid->cols * grid->rows;
+	tiles.tile_size = VFB_TILE_SIZE;
+	tiles.cols = grid->cols;
+	tiles.rows = grid->rows;
+
+	if (tiles.nr_words < DIV_ROUND_UP(n, 64)) {
+		/* tell the caller how much room it needs */
+		if (copy_to_user(argp, &tiles, sizeof(tiles)))
+			return -EFAULT;
+		return -ENOSPC;
+	}
+
+	bitmap = bitmap_zalloc(n, GFP_KERNEL);
+	words = kvmalloc_array(DIV_ROUND_UP(n, 64), sizeof(*words), GFP_KERNEL);
+	if (!bitmap || !words) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++)
+		if (grid->changed[i] > tiles.seq)
+			__set_bit(i, bitmap);
+	bitmap_to_arr64(words, bitmap, n);
+
+	tiles.seq = par->tile_seq;
+	if (copy_to_user(u64_to_user_ptr(tiles.bitmap), words,
+			 DIV_ROUND_UP(n, 64) * sizeof(*words)) ||
+	    copy_to_user(argp, &tiles, sizeof(tiles)))
+		ret = -EFAULT;
+out:
+	kvfree(words);
+	bitmap_free(bitmap);
+	return ret;
+}
+
+static int vfb_ioctl_capture(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_capture req;
+	struct vfb_ring *ring;
+	struct file *file;
+	int fd, ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	ring = par->ring;
+	if (req.nr_slots) {
+		if (ring)
+			return -EBUSY;
+		if (req.nr_slots < 2 || req.nr_slots > VFB_CAPTURE_MAX_SLOTS)
+			return -EINVAL;
+
+		/* the reference of the device once started */
+		ring = vfb_ring_alloc(req.nr_slots, req.interval_ms,
+				      (u64)vfb_capture_stride(&info->var) * info->var.yres);
+		if (!ring)
+			return -ENOMEM;
+	} else if (!ring) {
+		return -ENODATA;
+	}
+
+	kref_get(&ring->kref);
+	file = anon_inode_getfile("[vfb_capture]", &vfb_ring_fops, ring, O_RDONLY);
+	if (IS_ERR(file)) {
+		kref_put(&ring->kref, vfb_ring_free);
+		ret = PTR_ERR(file);
+		goto err;
+	}
+
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		ret = fd;
+		goto err;
+	}
+
+	req.nr_slots = ring->nr_slots;
+	req.interval_ms = ring->interval_ms;
+	req.fd = fd;
+	req.size = ring->size;
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		fput(file);
+		ret = -EFAULT;
+		goto err;
+	}
+
+	if (!par->ring) {
+		vfb_capture_damage_all(par);
+		WRITE_ONCE(par->ring, ring);
+		queue_delayed_work(system_wq, &par->capture_work, 0);
+	}
+
+	fd_install(fd, file);
+	return 0;
+err:
+	if (!par->ring)
+		kref_put(&ring->kref, vfb_ring_free);
+	return ret;
+}
+
+static void vfb_snap_free(struct vfb_snap *snap)
+{
+	unsigned long i;
+
+	for (i = 0; i < snap->npages; i++)
+		if (snap->pages[i])
+			put_page(snap->pages[i]);
+	bitmap_free(snap->copied);
+	kvfree(snap);
+}
+
+static ssize_t vfb_snap_read(struct file *file, char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	struct vfb_snap *snap = file->private_data;
+	struct vfb_snaps *hub = snap->hub;
+	loff_t pos = *ppos;
+	ssize_t ret = 0;
+	void *bounce;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= snap->size)
+		return 0;
+	count = min_t(u64, count, snap->size - pos);
+
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	while (count) {
+		u64 b = snap->start + pos;
+		size_t offset, c, left;
+		struct page *page;
+
+		if (b >= snap->wrap)
+			b -= snap->wrap;
+		offset = offset_in_page(b);
+		c = min_t(size_t, count, PAGE_SIZE - offset);
+
+		/* a writer copies the page under the lock before it writes */
+		spin_lock_irq(&hub->lock);
+		page = snap->pages[(b >> PAGE_SHIFT) - snap->first];
+		if (page)
+			memcpy_from_page(bounce, page, offset, c);
+		else
+			memset(bounce, 0, c);
+		spin_unlock_irq(&hub->lock);
+
+		left = copy_to_user(buf, bounce, c);
+		c -= left;
+		buf += c;
+		pos += c;
+		count -= c;
+		ret += c;
+
+		if (left) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+	}
+	free_page((unsigned long)bounce);
+
+	if (READ_ONCE(snap->torn))
+		return -EIO;
+
+	*ppos = pos;
+	return ret;
+}
+
+static loff_t vfb_snap_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct vfb_snap *snap = file->private_data;
+
+	return fixed_size_llseek(file, offset, whence, snap->size);
+}
+
+static void vfb_snap_remove(struct vfb_snap *snap)
+{
+	struct vfb_snaps *hub = snap->hub;
+
+	spin_lock_irq(&hub->lock);
+	list_del(&snap->list);
+	spin_unlock_irq(&hub->lock);
+
+	kref_put(&hub->kref, vfb_snaps_free);
+	vfb_snap_free(snap);
+}
+
+static int vfb_snap_release(struct inode *inode, struct file *file)
+{
+	vfb_snap_remove(file->private_data);
+	return 0;
+}
+
+static const struct file_operations vfb_snap_fops = {
+	.owner		= THIS_MODULE,
+	.read		= vfb_snap_read,
+	.llseek		= vfb_snap_llseek,
+	.release	= vfb_snap_release,
+};
+
+static int vfb_ioctl_snapshot(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_snaps *hub = par->snaps;
+	u64 line_length = info->fix.line_length;
+	u64 vsize = line_length * info->var.yres_virtual;
+	struct fb_var_screeninfo var = info->var;
+	struct vfb_snapshot req;
+	struct vfb_snap *snap;
+	struct file *file;
+	unsigned long i, npages;
+	u64 start, size, lo, hi;
+	int fd, ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if ((req.flags & ~O_CLOEXEC) || req.reserved)
+		return -EINVAL;
+
+	vfb_front(par, &var);
+	start = line_length * var.yoffset;
+	size = line_length * var.yres;
+	if (start + size <= vsize) {
+		lo = start;
+		hi = start + size;
+	} else {
+		/* wrapped, take it all */
+		lo = 0;
+		hi = vsize;
+	}
+	npages = DIV_ROUND_UP(hi, PAGE_SIZE) - (lo >> PAGE_SHIFT);
+
+	snap = kvzalloc(struct_size(snap, pages, npages), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	snap->copied = bitmap_zalloc(npages, GFP_KERNEL);
+	if (!snap->copied) {
+		kvfree(snap);
+		return -ENOMEM;
+	}
+	snap->hub = hub;
+	snap->start = start;
+	snap->size = size;
+	snap->wrap = vsize;
+	snap->first = lo >> PAGE_SHIFT;
+	snap->npages = npages;
+
+	mutex_lock(&par->lock);
+	if (par->mem->alloc == VFB_ALLOC_SHMEM || par->mem->alloc == VFB_ALLOC_DMABUF ||
+	    snap->first + npages > par->mem->npages) {
+		mutex_unlock(&par->lock);
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	for (i = 0; i < npages; i++) {
+		snap->pages[i] = par->mem->pages[snap->first + i];
+		if (snap->pages[i])
+			get_page(snap->pages[i]);
+	}
+
+	spin_lock_irq(&hub->lock);
+	list_add_tail(&snap->list, &hub->list);
+	spin_unlock_irq(&hub->lock);
+
+	/* the next write through a mapping faults into vfb_vm_page_mkwrite() */
+	if (par->mapping)
+		unmap_mapping_range(par->mapping, lo & PAGE_MASK,
+				    (u64)npages << PAGE_SHIFT, 0);
+	mutex_unlock(&par->lock);
+
+	kref_get(&hub->kref);
+	file = anon_inode_getfile("[vfb_snapshot]", &vfb_snap_fops, snap, O_RDONLY);
+	if (IS_ERR(file)) {
+		vfb_snap_remove(snap);
+		return PTR_ERR(file);
+	}
+	file->f_mode |= FMODE_LSEEK | FMODE_PREAD;
+
+	/* snap is released with the file from here on */
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		return fd;
+	}
+
+	req.fd = fd;
+	req.size = size;
+	req.xoffset = var.xoffset;
+	req.width = info->var.xres;
+	req.height = info->var.yres;
+	req.line_length = line_length;
+	req.bits_per_pixel = info->var.bits_per_pixel;
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		fput(file);
+		return -EFAULT;
+	}
+
+	fd_install(fd, file);
+	return 0;
+err:
+	vfb_snap_free(snap);
+	return ret;
+}
+
+    /*
+     *  All rectangles are checked before anything is copied, their place
+     *  in the caller's buffer depends on the ones before.
+     */
+
+static int vfb_ioctl_rects_io(struct fb_info *info, void __user *argp, bool write)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	struct vfb_rect_io io;
+	struct vfb_rect *rects, *r;
+	size_t len, max_len = 0, batch;
+	u8 __user *data;
+	u64 off = 0;
+	u32 i, y, rows;
+	u8 *bounce;
+	int ret = 0;
+
+	if (copy_from_user(&io, argp, sizeof(io)))
+		return -EFAULT;
+
+	if (io.flags || io.reserved || !io.nr_rects)
+		return -EINVAL;
+
+	if (io.nr_rects > VFB_RECT_IO_MAX_RECTS)
+		return -E2BIG;
+
+	rects = vmemdup_user(u64_to_user_ptr(io.rects),
+			     array_size(io.nr_rects, sizeof(*rects)));
+	if (IS_ERR(rects))
+		return PTR_ERR(rects);
+
+	for (i = 0; i < io.nr_rects; i++) {
+		r = &rects[i];
+		len = vfb_rect_line_bytes(r->width, bpp);
+		if (!r->width || !r->height ||
+		    (u64)r->x + r->width > info->var.xres_virtual ||
+		    (u64)r->y + r->height > info->var.yres_virtual ||
+		    len > io.pitch ||
+		    off + (u64)(r->height - 1) * io.pitch + len > io.size) {
+			ret = -EINVAL;
+			goto out;
+		}
+		off += (u64)r->height * io.pitch;
+		max_len = max(max_len, len);
+	}
+
+	batch = max_t(size_t, VFB_RECT_IO_BOUNCE / max_len, 1);
+	/* and a line for 1 bpp */
+	bounce = kvmalloc((batch + 1) * max_len + 1, GFP_KERNEL);
+	if (!bounce) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	off = 0;
+	for (i = 0; i < io.nr_rects && !ret; i++) {
+		r = &rects[i];
+		len = vfb_rect_line_bytes(r->width, bpp);
+
+		for (y = 0; y < r->height && !ret; y += rows) {
+			rows = min_t(size_t, r->height - y, batch);
+			data = u64_to_user_ptr(io.data + off + (u64)y * io.pitch);
+
+			if (write) {
+				ret = vfb_rows_from_user(bounce, data, io.pitch, len, rows);
+				if (ret)
+					break;
+			}
+
+			/* breaks snapshots and records dirty pages like write() */
+			ret = vfb_rect_rw(info, bounce, bounce + batch * max_len, r,
+					  r->y + y, rows, write);
+
+			if (!ret && !write)
+				ret = vfb_rows_to_user(data, io.pitch, bounce, len, rows);
+		}
+
+		if (write && y)
+			vfb_damage_add(info, r->x, r->y, r->width, min(y, r->height));
+		off += (u64)r->height * io.pitch;
+	}
+
+	kvfree(bounce);
+out:
+	kvfree(rects);
+	return ret;
+}
+
+static int vfb_ioctl_get_data_fd(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	struct vfb_data_fd req;
+	struct file *file;
+	int fd;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if ((req.flags & ~(O_CLOEXEC | O_ACCMODE)) ||
+	    (req.flags & O_ACCMODE) == O_WRONLY || (req.flags & O_ACCMODE) == O_ACCMODE)
+		return -EINVAL;
+
+	kref_get(&par->link->kref);
+	file = anon_inode_getfile("[vfb_data]", &vfb_data_fops, par->link,
+				  req.flags & O_ACCMODE);
+	if (IS_ERR(file)) {
+		kref_put(&par->link->kref, vfb_link_free);
+		return PTR_ERR(file);
 	}
-#undef CNVT_TOHW
-	/* Truecolor has hardware independent palette */
-	if (info->fix.visual == FB_VISUAL_TRUECOLOR) {
-		u32 v;
+	file->f_mode |= FMODE_LSEEK | FMODE_PREAD | FMODE_PWRITE;
 
-		if (regno >= 16)
-			return 1;
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		return fd;
+	}
 
-		v = (red << info->var.red.offset) |
-		    (green << info->var.green.offset) |
-		    (blue << info->var.blue.offset) |
-		    (transp << info->var.transp.offset);
-		switch (info->var.bits_per_pixel) {
-		case 8:
-			break;
-		case 16:
-			((u32 *) (info->pseudo_palette))[regno] = v;
-			break;
-		case 24:
-		case 32:
-			((u32 *) (info->pseudo_palette))[regno] = v;
-			break;
-		}
-		return 0;
+	req.fd = fd;
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		fput(file);
+		return -EFAULT;
 	}
+
+	fd_install(fd, file);
 	return 0;
 }
 
-    /*
-     *  Pan or Wrap the Display
-     *
-     *  This call looks only at xoffset, yoffset and the FB_VMODE_YWRAP flag
-     */
-
-static int vfb_pan_display(struct fb_var_screeninfo *var,
-			   struct fb_info *info)
+static int vfb_ioctl_capture_stop(struct fb_info *info)
 {
-	if (var->vmode & FB_VMODE_YWRAP) {
-		if (var->yoffset >= info->var.yres_virtual ||
-		    var->xoffset)
-			return -EINVAL;
-	} else {
-		if (var->xoffset + info->var.xres > info->var.xres_virtual ||
-		    var->yoffset + info->var.yres > info->var.yres_virtual)
-			return -EINVAL;
-	}
-	info->var.xoffset = var->xoffset;
-	info->var.yoffset = var->yoffset;
-	if (var->vmode & FB_VMODE_YWRAP)
-		info->var.vmode |= FB_VMODE_YWRAP;
-	else
-		info->var.vmode &= ~FB_VMODE_YWRAP;
+	struct vfb_par *par = info->par;
+
+	if (!par->ring)
+		return -ENODATA;
+
+	vfb_capture_stop(par);
 	return 0;
 }
 
-    /*
-     *  Most drivers don't need their own mmap function
-     */
+static int vfb_ioctl_wait_for_vsync(struct fb_info *info, u32 __user *argp)
+{
+	struct vfb_par *par = info->par;
+	unsigned long flags;
+	u64 seq, period;
+	u32 crtc;
+	long ret;
+
+	if (get_user(crtc, argp))
+		return -EFAULT;
+	if (crtc)
+		return -ENODEV;
 
-static int vfb_mmap(struct fb_info *info,
-		    struct vm_area_struct *vma)
+	/* with vrr, an idle head takes the longest period of its range */
+	spin_lock_irqsave(&par->vblank.lock, flags);
+	period = vfb_vblank_period(&par->vblank);
+	spin_unlock_irqrestore(&par->vblank.lock, flags);
+
+	seq = vfb_vblank_count(par, NULL);
+	vfb_vblank_get(par);
+
+	/*
+	 * fb_ioctl() and vfb_compat_ioctl() hold the fb lock, which a pan of
+	 * the producer needs in time for the very vblank waited for here.
+	 */
+	lockdep_assert_held(&info->lock);
+	unlock_fb_info(info);
+	ret = wait_event_interruptible_timeout(par->vblank.wait,
+					       vfb_vblank_count(par, NULL) != seq,
+					       nsecs_to_jiffies(period) + HZ / 10);
+	lock_fb_info(info);
+	vfb_vblank_put(par);
+
+	if (!ret)
+		return -ETIMEDOUT;
+	return ret < 0 ? ret : 0;
+}
+
+static int vfb_ioctl_get_vblank(struct fb_info *info, void __user *argp)
+{
+	struct vfb_par *par = info->par;
+	u64 vtotal = vfb_vtotal(&info->var);
+	u64 line_ns = max_t(u64, div64_u64(vfb_frame_ns(&info->var), vtotal), 1);
+	struct fb_vblank vblank = { 0 };
+	u64 pos, line;
+	ktime_t ts;
+
+	vblank.count = vfb_vblank_count(par, &ts);
+	pos = ktime_to_ns(ktime_sub(ktime_get(), ts));
+	line = min(div64_u64(pos, line_ns), vtotal - 1);
+
+	/* the frame starts with the blanking, right after the last visible line */
+	vblank.vcount = (info->var.yres + line) % vtotal;
+	vblank.hcount = div64_u64((pos - line * line_ns) * vfb_htotal(&info->var), line_ns);
+	vblank.flags = FB_VBLANK_HAVE_VBLANK | FB_VBLANK_HAVE_COUNT |
+		       FB_VBLANK_HAVE_VCOUNT | FB_VBLANK_HAVE_HCOUNT;
+	if (vblank.vcount >= info->var.yres)
+		vblank.flags |= FB_VBLANK_VBLANKING;
+
+	return copy_to_user(argp, &vblank, sizeof(vblank)) ? -EFAULT : 0;
+}
+
+static int vfb_ioctl(struct fb_info *info, unsigned int cmd,
+		     unsigned long arg)
 {
-	return remap_vmalloc_range(vma, (void *)info->fix.smem_start, vma->vm_pgoff);
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		return vfb_ioctl_wait_for_vsync(info, argp);
+	case FBIOGET_VBLANK:
+		return vfb_ioctl_get_vblank(info, argp);
+	case VFBIO_GET_MEMFD:
+		return vfb_ioctl_get_memfd(info, argp);
+	case VFBIO_EXPORT_DMABUF:
+		return vfb_ioctl_export_dmabuf(info, argp);
+	case VFBIO_GET_DIRTY:
+		return vfb_ioctl_get_dirty(info, argp);
+	case VFBIO_DAMAGE:
+		return vfb_ioctl_damage(info, argp);
+	case VFBIO_GET_DAMAGE:
+		return vfb_ioctl_get_damage(info, argp);
+	case VFBIO_GET_EVENT_FD:
+		return vfb_ioctl_get_event_fd(info, argp);
+	case VFBIO_GET_TILES:
+		return vfb_ioctl_get_tiles(info, argp);
+	case VFBIO_GET_UPDATE:
+		return vfb_ioctl_get_update(info, argp);
+	case VFBIO_CAPTURE:
+		return vfb_ioctl_capture(info, argp);
+	case VFBIO_CAPTURE_STOP:
+		return vfb_ioctl_capture_stop(info);
+	case VFBIO_SNAPSHOT:
+		return vfb_ioctl_snapshot(info, argp);
+	case VFBIO_GET_DATA_FD:
+		return vfb_ioctl_get_data_fd(info, argp);
+	case VFBIO_ACK_FLIP:
+		return vfb_flip_ack(info->par);
+	case VFBIO_READ_RECTS:
+		return vfb_ioctl_rects_io(info, argp, false);
+	case VFBIO_WRITE_RECTS:
+		return vfb_ioctl_rects_io(info, argp, true);
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+static int vfb_compat_ioctl(struct fb_info *info, unsigned int cmd,
+			    unsigned long arg)
+{
+	int ret;
+
+	/*
+	 * All structures in vfb.h have the same layout for 32-bit callers.
+	 * Unlike fb_ioctl, fb_compat_ioctl is called without the fb lock.
+	 */
+	lock_fb_info(info);
+	ret = vfb_ioctl(info, cmd, (unsigned long)compat_ptr(arg));
+	unlock_fb_info(info);
+
+	return ret;
 }
+#endif
 
 #ifndef MODULE
 /*
@@ -475,80 +5957,157 @@ static int __init vfb_setup(char *options)
 
 static int vfb_probe(struct platform_device *dev)
 {
-	void *videomemory;
+	const struct vfb_platform_data *pdata = dev_get_platdata(&dev->dev);
 	struct fb_info *info;
-	unsigned int size = PAGE_ALIGN(videomemorysize);
+	struct vfb_par *par;
 	int retval = -ENOMEM;
 
 	printk("vfb_probe\n");
 
-	/*
-	 * For real video cards we use ioremap.
-	 */
-	if (!(videomemory = vmalloc_32_user(size)))
-		return retval;
+	if (!pdata || !pdata->videomemorysize)
+		return -EINVAL;
 
-	info = framebuffer_alloc(sizeof(u32) * 256, &dev->dev);
+	info = framebuffer_alloc(sizeof(struct vfb_par), &dev->dev);
 	if (!info)
+		return retval;
+
+	par = info->par;
+	par->videomemorysize = pdata->videomemorysize;
+	par->max_videomemorysize = pdata->max_videomemorysize;
+	par->stride_align = pdata->stride_align;
+	par->alloc = pdata->alloc;
+	par->node = pdata->node;
+	par->info = info;
+	mutex_init(&par->lock);
+	spin_lock_init(&par->damage_lock);
+	INIT_DELAYED_WORK(&par->capture_work, vfb_capture_work);
+	INIT_DELAYED_WORK(&par->crc_work, vfb_crc_work);
+	vfb_vblank_init(par, pdata->vrr_min_hz, pdata->vrr_max_hz);
+
+	par->events = vfb_events_alloc();
+	par->snaps = vfb_snaps_alloc();
+	par->link = vfb_link_alloc(info);
+	par->crc = vfb_crc_alloc();
+	if (!par->events || !par->snaps || !par->link || !par->crc)
 		goto err;
 
-	info->screen_buffer = videomemory;
+	if (pdata->dirty) {
+		par->dirty_npages = vfb_mem_npages(par->alloc, max(par->videomemorysize,
+								   par->max_videomemorysize));
+		par->dirty = bitmap_zalloc(par->dirty_npages, GFP_KERNEL);
+		if (!par->dirty)
+			goto err;
+	}
+
+	if (pdata->import_memfd || pdata->import_dmabuf) {
+		par->mem = vfb_mem_import(pdata->import_memfd, pdata->import_dmabuf,
+					  &par->videomemorysize);
+		if (IS_ERR(par->mem)) {
+			retval = PTR_ERR(par->mem);
+			goto err;
+		}
+		par->max_videomemorysize = 0;
+	} else {
+		par->mem = vfb_mem_alloc(par->alloc, par->node, par->videomemorysize);
+		if (!par->mem)
+			goto err;
+	}
+
+	info->fix = vfb_fix;
+	vfb_update_videomemory(info);
+
 	info->fbops = &vfb_ops;
 
-	if (!fb_find_mode(&info->var, info, mode_option,
+	/* fb_find_mode() validates candidates through vfb_check_var() */
+	if (!fb_find_mode(&info->var, info,
+			  pdata->mode_option[0] ? pdata->mode_option : NULL,
 			  NULL, 0, &vfb_default, 8)){
 		fb_err(info, "Unable to find usable video mode.\n");
 		retval = -EINVAL;
 		goto err1;
 	}
 
-	info->fix = vfb_fix;
-	info->fix.smem_start = (unsigned long) videomemory;
-	info->fix.smem_len = videomemorysize;
-
-	info->pseudo_palette = info->par;
-	info->par = NULL;
+	info->pseudo_palette = par->pseudo_palette;
 
 	retval = fb_alloc_cmap(&info->cmap, 256, 0);
 	if (retval < 0)
 		goto err1;
 
+	/* may resize the video memory to the mode, so before anyone maps it */
+	retval = vfb_set_par(info);
+	if (retval < 0)
+		goto err2;
+
 	retval = register_framebuffer(info);
 	if (retval < 0)
 		goto err2;
 	
 	platform_set_drvdata(dev, info);
 
-	vfb_add_device_attr_uniq(info);
+	vfb_add_device_attrs(info);
+	vfb_debugfs_init(info);
 
-	vfb_set_par(info);
-
-	fb_info(info, "Virtual frame buffer device, using %ldK of video memory\n",
-		videomemorysize >> 10);
+	fb_info(info, "Virtual frame buffer device, using %luK of %s video memory on node %d\n",
+		par->videomemorysize >> 10, vfb_alloc_mode_names[par->mem->alloc], par->node);
 	return 0;
 err2:
 	fb_dealloc_cmap(&info->cmap);
 err1:
-	framebuffer_release(info);
+	vfb_mem_free(par->mem);
 err:
-	vfree(videomemory);
+	bitmap_free(par->dirty);
+	if (par->events)
+		vfb_events_kill(par->events);
+	if (par->snaps)
+		kref_put(&par->snaps->kref, vfb_snaps_free);
+	if (par->link)
+		kref_put(&par->link->kref, vfb_link_free);
+	if (par->crc)
+		kref_put(&par->crc->kref, vfb_crc_free);
+	framebuffer_release(info);
 	return retval;
 }
 
+    /*
+     *  Called on the last reference to the fb_info, which open files (and
+     *  so user mappings) keep alive past vfb_remove().
+     */
+
+static void vfb_destroy(struct fb_info *info)
+{
+	struct vfb_par *par = info->par;
+
+	printk("vfb_destroy\n");
+
+	vfb_link_cut(par->link);
+	vfb_capture_stop(par);
+	cancel_delayed_work_sync(&par->crc_work);
+	kref_put(&par->crc->kref, vfb_crc_free);
+	hrtimer_cancel(&par->vblank.timer);
+	/* the buffer may be cached and handed to another device */
+	vfb_snap_break(par->snaps, 0, ULONG_MAX, GFP_KERNEL);
+	kref_put(&par->snaps->kref, vfb_snaps_free);
+	vfb_mem_release(par->mem);
+	bitmap_free(par->dirty);
+	vfb_tiles_reset(par);
+	vfb_motion_free(&par->motion);
+	vfb_events_kill(par->events);
+	fb_dealloc_cmap(&info->cmap);
+	framebuffer_release(info);
+}
+
 static void vfb_remove(struct platform_device *dev)
 {
-	void *videomemory;
 	struct fb_info *info = platform_get_drvdata(dev);
+	struct vfb_par *par;
 
 	printk("vfb_remove\n");
 
 	if (info) {
-		videomemory = info->screen_buffer;
-		vfb_cleanup_device_attr_uniq(info);
+		par = info->par;
+		debugfs_remove_recursive(par->debugfs);
+		vfb_cleanup_device_attrs(info);
 		unregister_framebuffer(info);
-		vfree(videomemory);
-		fb_dealloc_cmap(&info->cmap);
-		framebuffer_release(info);
 	}
 }
 
@@ -560,7 +6119,188 @@ static struct platform_driver vfb_driver = {
 	},
 };
 
-static int vfb_create_device(const char* uniq)
+    /*
+     *  The node the calling task is confined to by its CPU affinity, or
+     *  NUMA_NO_NODE if it may run on several nodes.
+     */
+
+static int vfb_current_node(void)
+{
+	int node;
+
+	for_each_online_node(node)
+		if (cpumask_subset(current->cpus_ptr, cpumask_of_node(node)))
+			return node;
+
+	return NUMA_NO_NODE;
+}
+
+    /*
+     *  Look up the memory to import for fd, a dma-buf or a memfd (any
+     *  shmem file) opened for writing, in the writer's file table. The
+     *  references are dropped by the command once it is done. Memfds
+     *  sealed against writes are refused: the kernel mapping and the
+     *  mappings of /dev/fbN write them without going through the seals.
+     *  Seals added later are checked again on the write paths.
+     */
+
+static void vfb_put_import(struct vfb_platform_data *pdata)
+{
+	if (pdata->import_memfd)
+		fput(pdata->import_memfd);
+	if (pdata->import_dmabuf)
+		dma_buf_put(pdata->import_dmabuf);
+	pdata->import_memfd = NULL;
+	pdata->import_dmabuf = NULL;
+}
+
+static int vfb_get_import(int fd, struct vfb_platform_data *pdata)
+{
+	struct dma_buf *dmabuf;
+	struct file *file;
+
+	vfb_put_import(pdata);
+
+	dmabuf = dma_buf_get(fd);
+	if (!IS_ERR(dmabuf)) {
+		pdata->import_dmabuf = dmabuf;
+		return 0;
+	}
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	if (!shmem_file(file) || !(file->f_mode & FMODE_WRITE) ||
+	    vfb_shmem_sealed(file)) {
+		fput(file);
+		return -EINVAL;
+	}
+
+	pdata->import_memfd = file;
+	return 0;
+}
+
+static void vfb_default_platform_data(struct vfb_platform_data *pdata)
+{
+	memset(pdata, 0, sizeof(*pdata));
+	pdata->videomemorysize = videomemorysize;
+	if (mode_option)
+		strscpy(pdata->mode_option, mode_option, sizeof(pdata->mode_option));
+	pdata->node = vfb_current_node();
+}
+
+    /*
+     *  Parse the "key=value" options following the ID of an add command:
+     *
+     *      size=<bytes>[K|M|G]     video memory of the device
+     *      max_size=<bytes>[K|M|G] let the video memory follow the mode up
+     *                              to this size
+     *      mode=<mode_option>      preferred video mode (e.g. 1920x1080-32@60)
+     *      stride_align=<bytes>    align the line length to this many bytes
+     *      alloc=vmalloc|lazy|huge|shmem
+     *                              allocate the buffer up front, on demand,
+     *                              from huge pages or in a shmem file
+     *      node=<node>             NUMA node of the buffer (-1 for any), the
+     *                              default follows the CPU affinity of the
+     *                              writer
+     *      dirty=0|1               track pages written through mappings and
+     *                              write(), see VFBIO_GET_DIRTY
+     *      vrr=<min_hz>-<max_hz>   variable refresh: vblanks follow flips and
+     *                              damage within this range
+     *      fd=<fd>                 use the writer's dma-buf or memfd as the
+     *                              buffer, with its size (also for set)
+     */
+
+static int vfb_parse_options(char *options, struct vfb_platform_data *pdata)
+{
+	char *this_opt;
+	char *value;
+
+	while ((this_opt = strsep(&options, " \t")) != NULL) {
+		if (!*this_opt)
+			continue;
+
+		value = strchr(this_opt, '=');
+		if (!value || !value[1]) {
+			printk("<4>virtual_fb: option<%s> has no value\n", this_opt);
+			return -EINVAL;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(this_opt, "size")) {
+			char *end;
+
+			pdata->videomemorysize = memparse(value, &end);
+			if (*end || !pdata->videomemorysize) {
+				printk("<4>virtual_fb: invalid size<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "max_size")) {
+			char *end;
+
+			pdata->max_videomemorysize = memparse(value, &end);
+			if (*end) {
+				printk("<4>virtual_fb: invalid max_size<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "mode")) {
+			if (strscpy(pdata->mode_option, value, sizeof(pdata->mode_option)) < 0) {
+				printk("<4>virtual_fb: mode<%s> too long\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "stride_align")) {
+			if (kstrtouint(value, 0, &pdata->stride_align)) {
+				printk("<4>virtual_fb: invalid stride_align<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "alloc")) {
+			int mode = match_string(vfb_alloc_mode_names,
+						ARRAY_SIZE(vfb_alloc_mode_names), value);
+
+			/* dma-bufs come with fd= */
+			if (mode < 0 || mode == VFB_ALLOC_DMABUF) {
+				printk("<4>virtual_fb: invalid alloc<%s>\n", value);
+				return -EINVAL;
+			}
+			pdata->alloc = mode;
+		} else if (!strcmp(this_opt, "node")) {
+			if (kstrtoint(value, 0, &pdata->node) ||
+			    (pdata->node != NUMA_NO_NODE &&
+			     (pdata->node < 0 || pdata->node >= MAX_NUMNODES ||
+			      !node_online(pdata->node)))) {
+				printk("<4>virtual_fb: invalid node<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "dirty")) {
+			if (kstrtobool(value, &pdata->dirty)) {
+				printk("<4>virtual_fb: invalid dirty<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "vrr")) {
+			if (sscanf(value, "%u-%u", &pdata->vrr_min_hz, &pdata->vrr_max_hz) != 2 ||
+			    !pdata->vrr_min_hz || pdata->vrr_min_hz > pdata->vrr_max_hz ||
+			    pdata->vrr_max_hz > VFB_MAX_REFRESH) {
+				printk("<4>virtual_fb: invalid vrr<%s>\n", value);
+				return -EINVAL;
+			}
+		} else if (!strcmp(this_opt, "fd")) {
+			int fd;
+
+			if (kstrtoint(value, 0, &fd) || vfb_get_import(fd, pdata)) {
+				printk("<4>virtual_fb: invalid fd<%s>, not a dma-buf or writable, unsealed memfd\n", value);
+				return -EINVAL;
+			}
+		} else {
+			printk("<4>virtual_fb: unknown option<%s>\n", this_opt);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int vfb_create_device(const char* uniq, const struct vfb_platform_data *pdata)
 {
 	int ret;
 	int pdpidx = -1;
@@ -609,7 +6349,17 @@ static int vfb_create_device(const char* uniq)
 	vfb_device_pool[pdpidx].dev = platform_device_alloc(VFB_DRIVER_NAME, pdpidx);
 
 	if (vfb_device_pool[pdpidx].dev) {
-		ret = platform_device_add(vfb_device_pool[pdpidx].dev);
+		set_dev_node(&vfb_device_pool[pdpidx].dev->dev, pdata->node);
+		ret = platform_device_add_data(vfb_device_pool[pdpidx].dev, pdata, sizeof(*pdata));
+		if (!ret)
+			ret = platform_device_add(vfb_device_pool[pdpidx].dev);
+		if (!ret) {
+			struct vfb_platform_data *added = dev_get_platdata(&vfb_device_pool[pdpidx].dev->dev);
+
+			/* probed synchronously above, the caller drops these */
+			added->import_memfd = NULL;
+			added->import_dmabuf = NULL;
+		}
 	} else {
 		ret = -ENOMEM;
 	}
@@ -650,6 +6400,48 @@ void vfb_delete_device(const char* uniq)
 	printk("vfb_delete_device: device not found\n");
 }
 
+    /*
+     *  Re-point an existing device at the memory to import in pdata.
+     *  Serialised against mode changes and console drawing like
+     *  FBIOPUT_VSCREENINFO.
+     */
+
+static int vfb_import_device(const char* uniq, const struct vfb_platform_data *pdata)
+{
+	struct fb_info *info = NULL;
+	int ret = -ENODEV;
+
+	printk("vfb_import_device [%s]\n", uniq);
+
+	if (!pdata->import_memfd && !pdata->import_dmabuf) {
+		printk("vfb_import_device: no fd given\n");
+		return -EINVAL;
+	}
+
+	/* held throughout, so the device can't be deleted meanwhile */
+	mutex_lock(&vfb_device_pool_lock);
+	for (int i = 0; i < VFB_DEVICE_POOL_SIZE; i++) {
+		if (vfb_device_pool[i].in_use
+			&& (0 == strncmp(vfb_device_pool[i].uniq, uniq, sizeof(vfb_device_pool[i].uniq) - 1))) {
+			info = platform_get_drvdata(vfb_device_pool[i].dev);
+			break;
+		}
+	}
+
+	if (info) {
+		console_lock();
+		lock_fb_info(info);
+		ret = vfb_import_videomemory(info, pdata->import_memfd, pdata->import_dmabuf);
+		unlock_fb_info(info);
+		console_unlock();
+	} else {
+		printk("vfb_import_device: device not found\n");
+	}
+	mutex_unlock(&vfb_device_pool_lock);
+
+	return ret;
+}
+
 static void vfb_get_device_uniq(struct fb_info *fb_info, char* uniq, size_t max_len)
 {
 	mutex_lock(&vfb_device_pool_lock);
@@ -688,6 +6480,7 @@ static void vfb_delete_devices(void)
 
 static int __init vfb_init(void)
 {
+	struct vfb_platform_data pdata;
 	int ret = 0;
 
 	printk("vfb_init\n");
@@ -705,15 +6498,25 @@ static int __init vfb_init(void)
 
 	memset(&vfb_device_pool, 0, sizeof(vfb_device_pool));
 
+	vfb_cache_init();
+	vfb_debugfs_root = debugfs_create_dir(VFB_DRIVER_NAME, NULL);
+	debugfs_create_file("cache", S_IRUGO, vfb_debugfs_root, NULL, &vfb_cache_fops);
+
 	ret = platform_driver_register(&vfb_driver);
 
 	if (!ret) {
-		ret = vfb_create_device("");
+		vfb_default_platform_data(&pdata);
+		ret = vfb_create_device("", &pdata);
 		if (ret) {
 			platform_driver_unregister(&vfb_driver);
 		}
 	}
 
+	if (ret) {
+		vfb_cache_drain();
+		debugfs_remove_recursive(vfb_debugfs_root);
+	}
+
 	if (!ret) {
 		vfb_devhandler_init();
 	}
@@ -732,11 +6535,15 @@ static void __exit vfb_exit(void)
 
 	vfb_delete_devices();
 	platform_driver_unregister(&vfb_driver);
+
+	vfb_cache_drain();
+	debugfs_remove_recursive(vfb_debugfs_root);
 }
 
 module_exit(vfb_exit);
 
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 #endif				/* MODULE */
 
 
@@ -753,15 +6560,71 @@ static ssize_t vfb_show_uniq(struct device *device,
 	return sysfs_emit(buf, "%s\n", uniq_buff);
 }
 
-static int vfb_add_device_attr_uniq(struct fb_info *fb_info)
+static ssize_t vfb_show_alloc(struct device *device,
+			 struct device_attribute *attr, char *buf)
+{
+	struct fb_info *fb_info = dev_get_drvdata(device);
+	struct vfb_par *par = fb_info->par;
+	enum vfb_alloc_mode alloc;
+
+	mutex_lock(&par->lock);
+	alloc = par->mem->alloc;
+	mutex_unlock(&par->lock);
+
+	return sysfs_emit(buf, "%s\n", vfb_alloc_mode_names[alloc]);
+}
+
+static ssize_t vfb_show_node(struct device *device,
+			 struct device_attribute *attr, char *buf)
+{
+	struct fb_info *fb_info = dev_get_drvdata(device);
+	struct vfb_par *par = fb_info->par;
+
+	return sysfs_emit(buf, "%d\n", par->node);
+}
+
+static ssize_t vfb_show_size(struct device *device,
+			 struct device_attribute *attr, char *buf)
+{
+	struct fb_info *fb_info = dev_get_drvdata(device);
+	struct vfb_par *par = fb_info->par;
+
+	return sysfs_emit(buf, "%lu\n", par->videomemorysize);
+}
+
+static ssize_t vfb_show_vblank(struct device *device,
+			 struct device_attribute *attr, char *buf)
+{
+	struct fb_info *fb_info = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%llu\n", vfb_vblank_count(fb_info->par, NULL));
+}
+
+static ssize_t vfb_show_vrr(struct device *device,
+			 struct device_attribute *attr, char *buf)
+{
+	struct fb_info *fb_info = dev_get_drvdata(device);
+	struct vfb_par *par = fb_info->par;
+	struct vfb_vblank *vb = &par->vblank;
+
+	if (!vb->vrr)
+		return sysfs_emit(buf, "off\n");
+
+	return sysfs_emit(buf, "%llu-%llu\n", div64_u64(NSEC_PER_SEC, vb->max_period),
+			  div64_u64(NSEC_PER_SEC, vb->min_period));
+}
+
+static int vfb_add_device_attrs(struct fb_info *fb_info)
 {
-	device_create_file(fb_info->dev, &vfb_device_attr_uniq);
+	for (int i = 0; vfb_device_attrs[i]; i++)
+		device_create_file(fb_info->dev, vfb_device_attrs[i]);
 	return 0;
 }
 
-static void vfb_cleanup_device_attr_uniq(struct fb_info *fb_info)
+static void vfb_cleanup_device_attrs(struct fb_info *fb_info)
 {
-	device_remove_file(fb_info->dev, &vfb_device_attr_uniq);
+	for (int i = 0; vfb_device_attrs[i]; i++)
+		device_remove_file(fb_info->dev, vfb_device_attrs[i]);
 }
 
 
@@ -786,8 +6649,20 @@ static ssize_t vfb_devhandler_read(struct file *filp, char *buffer, size_t lengt
 {
     const char* message = 
         "Usage: write the following commands to /dev/virtual_fb:\n"
-        "    add <ID>  - add new fb device\n"
-        "    del <ID>  - delete fb device\n";
+        "    add <ID> [options]  - add new fb device\n"
+        "    set <ID> fd=<fd>    - re-point fb device at a dma-buf or memfd\n"
+        "    del <ID>            - delete fb device\n"
+        "Options of add (key=value, separated by spaces):\n"
+        "    size=<bytes>[K|M|G]   - video memory of the device\n"
+        "    max_size=<bytes>[K|M|G] - resize video memory with the mode, up to this\n"
+        "    mode=<mode>           - preferred video mode (e.g. 1920x1080-32@60)\n"
+        "    stride_align=<bytes>  - line length alignment\n"
+        "    alloc=vmalloc|lazy|huge|shmem - allocate video memory up front, on first\n"
+        "                            touch, from huge pages or in a shmem file\n"
+        "    node=<node>           - NUMA node of video memory (default: the writer's)\n"
+        "    dirty=0|1             - track written pages for VFBIO_GET_DIRTY\n"
+        "    vrr=<min_hz>-<max_hz> - vblanks follow flips and damage within this range\n"
+        "    fd=<fd>               - use the writer's dma-buf or memfd as video memory\n";
     const size_t msgsize = strlen(message);
     loff_t off = *offset;
 
@@ -808,10 +6683,26 @@ static ssize_t vfb_devhandler_read(struct file *filp, char *buffer, size_t lengt
     return length;
 }
 	
-static void vfb_devhandler_execute_command(const char *cmd, const char* name)
+static void vfb_devhandler_execute_command(const char *cmd, const char* name, char *options)
 {
     if (0 == strncmp(cmd, "add", 3)) {
-		vfb_create_device(name);
+		struct vfb_platform_data pdata;
+
+		vfb_default_platform_data(&pdata);
+		if (vfb_parse_options(options, &pdata))
+			printk("<4>virtual_fb: invalid options for ID<%s>\n", name);
+		else
+			vfb_create_device(name, &pdata);
+		vfb_put_import(&pdata);
+    } else if (0 == strncmp(cmd, "set", 3)) {
+		struct vfb_platform_data pdata;
+
+		vfb_default_platform_data(&pdata);
+		if (vfb_parse_options(options, &pdata))
+			printk("<4>virtual_fb: invalid options for ID<%s>\n", name);
+		else
+			vfb_import_device(name, &pdata);
+		vfb_put_import(&pdata);
     } else if (0 == strncmp(cmd, "del", 3)) {
 		vfb_delete_device(name);
     } else {
@@ -819,15 +6710,41 @@ static void vfb_devhandler_execute_command(const char *cmd, const char* name)
     }
 }
 
+    /*
+     *  The ID may contain spaces, options start at the first "key=value"
+     *  word. Terminates the ID and returns the options.
+     */
+
+static char *vfb_devhandler_split_options(char *args)
+{
+    char *eq = strchr(args, '=');
+    char *sep;
+
+    if (!eq)
+        return args + strlen(args);
+
+    *eq = '\0';
+    sep = strrchr(args, ' ');
+    *eq = '=';
+
+    if (!sep)
+        return args + strlen(args);
+
+    *sep = '\0';
+    return sep + 1;
+}
+
 static ssize_t vfb_devhandler_write(struct file *filp, const char *ubuf, size_t len, loff_t *off)
 {
-    char cmd[4] = {0};
+    char cmd[5] = {0};
     char vfb_uniq[VFB_UNIQ_LEN] = {0};
 
-    char buf[VFB_UNIQ_LEN * 2];
+    char buf[VFB_CMD_LEN];
     size_t len_to_use = len;
     size_t i;
     size_t p = 0;
+    char *options;
+    int n;
 
     if (len_to_use > sizeof(buf)) {
 		len_to_use = sizeof(buf);
@@ -840,12 +6757,17 @@ static ssize_t vfb_devhandler_write(struct file *filp, const char *ubuf, size_t
     for (i = 0; i < len_to_use; ++i) {
         if (buf[i] == '\n') {
             buf[i] = '\0';
-            if (sscanf(buf + p, "%4s %" VFB_UNIQ_LEN_S "[^\n]", cmd, vfb_uniq) != 2) {
+            n = 0;
+            if (sscanf(buf + p, "%4s %n", cmd, &n) != 1 || n == 0) {
                 printk("<4>virtual_fb: sscanf failed to interpret this input\n");
+                n = i - p;
             }
-            p = i + 1;
 
-			vfb_devhandler_execute_command(cmd, vfb_uniq);
+            options = vfb_devhandler_split_options(buf + p + n);
+            strscpy(vfb_uniq, strim(buf + p + n), sizeof(vfb_uniq));
+
+			vfb_devhandler_execute_command(cmd, vfb_uniq, options);
+            p = i + 1;
         }
     }
 
@@ -0,0 +1,368 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ *  vfb.h -- ioctl interface of the virtual frame buffer device
+ *
+ *  The ioctls are issued on /dev/fbN of a vfb device.
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License. See the file COPYING in the main directory of this archive for
+ *  more details.
+ */
+
+#ifndef _UAPI_VFB_H
+#define _UAPI_VFB_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define VFB_IOCTL_MAGIC		'F'
+
+    /*
+     *  VFBIO_GET_MEMFD - file descriptor of the shmem file backing a device
+     *  created with alloc=shmem. It can be mmap()ed directly.
+     *
+     *  flags:  0 or O_CLOEXEC
+     *  fd:     returned descriptor
+     */
+
+struct vfb_memfd {
+	__u32 flags;
+	__s32 fd;
+};
+
+#define VFBIO_GET_MEMFD		_IOWR(VFB_IOCTL_MAGIC, 0xc0, struct vfb_memfd)
+
+    /*
+     *  VFBIO_EXPORT_DMABUF - export the video memory of a device as a
+     *  dma-buf. The export keeps the memory it was made from: after a mode
+     *  change that resizes the buffer it no longer shows the device.
+     *  A device backed by an imported dma-buf hands that one out again.
+     *
+     *  flags:  O_CLOEXEC, O_RDONLY (default) or O_RDWR
+     *  fd:     returned dma-buf descriptor
+     *  size:   returned size of the dma-buf in bytes
+     */
+
+struct vfb_export_dmabuf {
+	__u32 flags;
+	__s32 fd;
+	__u64 size;
+};
+
+#define VFBIO_EXPORT_DMABUF	_IOWR(VFB_IOCTL_MAGIC, 0xc1, struct vfb_export_dmabuf)
+
+    /*
+     *  A rectangle of the virtual screen, in pixels.
+     */
+
+struct vfb_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+    /*
+     *  VFBIO_GET_DIRTY - collect and clear the areas written through
+     *  mappings of /dev/fbN or write() since the last call, on devices
+     *  created with dirty=1. The areas are page granular, reported as full
+     *  width bands of lines. Not available for shmem or dma-buf backing.
+     *
+     *  rects:    pointer to an array of struct vfb_rect
+     *  nr_rects: in: size of the array, out: number of rectangles filled
+     *  flags:    0
+     */
+
+struct vfb_dirty {
+	__u64 rects;
+	__u32 nr_rects;
+	__u32 flags;
+};
+
+#define VFBIO_GET_DIRTY		_IOWR(VFB_IOCTL_MAGIC, 0xc2, struct vfb_dirty)
+
+    /*
+     *  VFBIO_DAMAGE - tell which areas were redrawn, like FB_DAMAGE_CLIPS.
+     *  No rectangles means the whole virtual screen.
+     *  VFBIO_GET_DAMAGE - fetch and reset the merged damage: what was
+     *  submitted plus what the in-kernel drawing ops touched. Up to 8
+     *  rectangles, a single bounding box if the array is smaller.
+     *
+     *  rects:    pointer to an array of struct vfb_rect
+     *  nr_rects: number of rectangles (submit, at most 4096), size of the
+     *            array (fetch, returns the number filled)
+     *  flags:    0
+     */
+
+struct vfb_damage {
+	__u64 rects;
+	__u32 nr_rects;
+	__u32 flags;
+};
+
+#define VFBIO_DAMAGE		_IOW(VFB_IOCTL_MAGIC, 0xc3, struct vfb_damage)
+#define VFBIO_GET_DAMAGE	_IOWR(VFB_IOCTL_MAGIC, 0xc4, struct vfb_damage)
+
+    /*
+     *  VFBIO_GET_EVENT_FD - fd that becomes readable (poll/epoll) when one
+     *  of the selected events happens. read() returns a struct vfb_event
+     *  for each event type that happened since the last read. Events of
+     *  one type are coalesced, seq counts them per device. timestamp is
+     *  CLOCK_MONOTONIC in ns. read() returns 0 once the device is gone.
+     *
+     *  events:   VFB_EVENT_* mask
+     *  flags:    O_CLOEXEC, O_NONBLOCK
+     *  fd:       returned descriptor
+     *  reserved: 0
+     */
+
+#define VFB_EVENT_DAMAGE	(1 << 0)	/* VFBIO_DAMAGE or in-kernel drawing */
+#define VFB_EVENT_PAN		(1 << 1)	/* FBIOPAN_DISPLAY */
+#define VFB_EVENT_DIRTY		(1 << 2)	/* pages became dirty, see VFBIO_GET_DIRTY */
+#define VFB_EVENT_CAPTURE	(1 << 3)	/* a frame was published, see VFBIO_CAPTURE */
+#define VFB_EVENT_FLIP		(1 << 4)	/* a pan took effect, queued ones at vblank */
+#define VFB_EVENT_ALL		(VFB_EVENT_DAMAGE | VFB_EVENT_PAN | VFB_EVENT_DIRTY | \
+				 VFB_EVENT_CAPTURE | VFB_EVENT_FLIP)
+
+struct vfb_event_fd {
+	__u32 events;
+	__u32 flags;
+	__s32 fd;
+	__u32 reserved;
+};
+
+struct vfb_event {
+	__u32 type;
+	__u32 reserved;
+	__u64 seq;
+	__u64 timestamp;
+};
+
+#define VFBIO_GET_EVENT_FD	_IOWR(VFB_IOCTL_MAGIC, 0xc5, struct vfb_event_fd)
+
+    /*
+     *  VFBIO_GET_TILES - which tiles of the virtual screen changed since
+     *  seq. The screen is hashed in tile_size square tiles on each call,
+     *  bit n of the bitmap (bit n % 64 of word n / 64) stands for the tile
+     *  in column n % cols, row n / cols. A mode change reports all tiles.
+     *
+     *  bitmap:    pointer to an array of __u64
+     *  nr_words:  size of the array, -ENOSPC (with cols and rows set) if
+     *             too small
+     *  tile_size: returned tile width and height in pixels
+     *  cols:      returned number of tile columns
+     *  rows:      returned number of tile rows
+     *  seq:       in: seq returned by the previous call, 0 for all tiles
+     *             out: current sequence number
+     */
+
+struct vfb_tiles {
+	__u64 bitmap;
+	__u32 nr_words;
+	__u32 tile_size;
+	__u32 cols;
+	__u32 rows;
+	__u64 seq;
+};
+
+#define VFBIO_GET_TILES		_IOWR(VFB_IOCTL_MAGIC, 0xc6, struct vfb_tiles)
+
+    /*
+     *  VFBIO_GET_UPDATE - fetch and reset the changes as copies plus
+     *  damage. Replay the copies in order on the last frame fetched, then
+     *  refresh the damaged rectangles. Copies come from the in-kernel
+     *  copyarea (console scrolling), or with VFB_UPDATE_DETECT from
+     *  comparing the frame with the one of the previous detection by line
+     *  and column hashes, which finds scrolling done through a mapping.
+     *  Recorded copies it doesn't find again are turned into damage, the
+     *  recorded damage is kept. Up to 8 copies and 8 rectangles. Copies
+     *  that don't fit are turned into damage, damage that doesn't fit
+     *  into its bounding box.
+     *
+     *  copies:    pointer to an array of struct vfb_copy_rect
+     *  rects:     pointer to an array of struct vfb_rect
+     *  nr_copies: size of the copies array, returns the number filled
+     *  nr_rects:  size of the rects array (> 0), returns the number filled
+     *  flags:     VFB_UPDATE_DETECT or 0
+     *  reserved:  0
+     */
+
+struct vfb_copy_rect {
+	__u32 src_x;
+	__u32 src_y;
+	struct vfb_rect dst;
+};
+
+#define VFB_UPDATE_DETECT	(1 << 0)
+
+struct vfb_update {
+	__u64 copies;
+	__u64 rects;
+	__u32 nr_copies;
+	__u32 nr_rects;
+	__u32 flags;
+	__u32 reserved;
+};
+
+#define VFBIO_GET_UPDATE	_IOWR(VFB_IOCTL_MAGIC, 0xc7, struct vfb_update)
+
+    /*
+     *  VFBIO_CAPTURE - start capturing, or join a running capture. Every
+     *  pan, and with interval_ms every interval, the visible frame is
+     *  copied into the next slot of a ring, which the returned fd maps
+     *  read-only: a struct vfb_capture_header with nr_slots slot headers,
+     *  and at data_offset the frames, slot_size bytes apart. The lines of
+     *  a frame are stride bytes apart and start at xoffset of the pan.
+     *
+     *  Nothing locks the ring against the consumer. The driver makes a
+     *  slot's seq odd before it writes the slot and even again after, so
+     *  a frame is read consistently like this:
+     *
+     *	frame = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+     *	slot = &hdr->slots[frame % hdr->nr_slots];
+     *	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+     *	if (seq & 1 || slot->frame != frame)
+     *		retry;
+     *	... copy the slot header and frame ...
+     *	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+     *	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+     *		retry;
+     *
+     *  Older frames stay readable until the ring wraps around. Frames that
+     *  no longer fit into a slot after a mode change are not published,
+     *  stop and restart the capture then.
+     *
+     *  nr_slots:    in: 2 - 64 to start a capture, 0 to join the running
+     *               one (-ENODATA if none), -EBUSY if already running
+     *               out: number of slots
+     *  interval_ms: in: publish period, 0 on pan only; out: period
+     *  flags:       O_CLOEXEC or 0
+     *  fd:          returned file descriptor
+     *  size:        returned size of the mapping
+     *
+     *  VFBIO_CAPTURE_STOP - stop capturing. Mappings stay valid, the ring
+     *  doesn't change anymore.
+     */
+
+struct vfb_capture {
+	__u32 nr_slots;
+	__u32 interval_ms;
+	__u32 flags;
+	__s32 fd;
+	__u64 size;
+};
+
+struct vfb_capture_slot {
+	__u64 seq;		/* odd while the slot is written */
+	__u64 frame;		/* frame number, slot frame % nr_slots */
+	__u64 timestamp;	/* CLOCK_MONOTONIC, ns */
+	__u32 width;
+	__u32 height;
+	__u32 stride;
+	__u32 bits_per_pixel;
+	struct vfb_rect damage;	/* changes since the previous frame, in the frame */
+};
+
+struct vfb_capture_header {
+	__u32 nr_slots;
+	__u32 reserved;
+	__u64 slot_size;
+	__u64 data_offset;
+	__u64 head;		/* number of the latest frame, 0 if none yet */
+	struct vfb_capture_slot slots[];
+};
+
+#define VFBIO_CAPTURE		_IOWR(VFB_IOCTL_MAGIC, 0xc8, struct vfb_capture)
+#define VFBIO_CAPTURE_STOP	_IO(VFB_IOCTL_MAGIC, 0xc9)
+
+    /*
+     *  VFBIO_SNAPSHOT - freeze the visible frame. The returned fd reads
+     *  (read(), pread()) the visible lines as they were when taken, from
+     *  the first one on, also when they wrap around with FB_VMODE_YWRAP.
+     *  Pages the frame is in are copied when first written while the fd is
+     *  open, untouched pages are shared with the buffer. Reads fail with
+     *  -EIO if a copy couldn't be made. -EOPNOTSUPP for shmem and imported
+     *  buffers.
+     *
+     *  flags:          O_CLOEXEC or 0
+     *  fd:             returned file descriptor
+     *  size:           returned size, height * line_length
+     *  xoffset:        returned first visible pixel of each line
+     *  width:          returned visible pixels per line
+     *  height:         returned number of lines
+     *  line_length:    returned bytes per line
+     *  bits_per_pixel: returned
+     */
+
+struct vfb_snapshot {
+	__u32 flags;
+	__s32 fd;
+	__u64 size;
+	__u32 xoffset;
+	__u32 width;
+	__u32 height;
+	__u32 line_length;
+	__u32 bits_per_pixel;
+	__u32 reserved;
+};
+
+#define VFBIO_SNAPSHOT		_IOWR(VFB_IOCTL_MAGIC, 0xca, struct vfb_snapshot)
+
+    /*
+     *  VFBIO_GET_DATA_FD - get an fd to read and write the video memory
+     *  with, at the same offsets as /dev/fbN. Unlike /dev/fbN it supports
+     *  splice(), sendfile() and io_uring, splicing hands the buffer pages
+     *  to the pipe without copying them. Once the device is gone reads
+     *  return EOF and writes -ENODEV.
+     *
+     *  flags: O_RDONLY or O_RDWR, optionally O_CLOEXEC
+     *  fd:    returned file descriptor
+     */
+
+struct vfb_data_fd {
+	__u32 flags;
+	__s32 fd;
+};
+
+#define VFBIO_GET_DATA_FD	_IOWR(VFB_IOCTL_MAGIC, 0xcb, struct vfb_data_fd)
+
+    /*
+     *  VFBIO_READ_RECTS, VFBIO_WRITE_RECTS - copy rectangles of the
+     *  virtual screen out of or into a buffer in one call. The rectangles
+     *  follow each other in the buffer, each taking height lines of pitch
+     *  bytes, the pixels of a line packed from its start in the frame's
+     *  format. At 1 bpp a line starts at the most significant bit of its
+     *  first byte. Writes are added to the damage. Up to 4096 rectangles,
+     *  all of them within the virtual screen.
+     *
+     *  rects:    pointer to an array of struct vfb_rect
+     *  data:     pointer to the buffer
+     *  size:     size of the buffer
+     *  nr_rects: number of rectangles
+     *  pitch:    bytes between lines in the buffer
+     *  flags:    0
+     *  reserved: 0
+     */
+
+struct vfb_rect_io {
+	__u64 rects;
+	__u64 data;
+	__u64 size;
+	__u32 nr_rects;
+	__u32 pitch;
+	__u32 flags;
+	__u32 reserved;
+};
+
+#define VFBIO_READ_RECTS	_IOW(VFB_IOCTL_MAGIC, 0xcc, struct vfb_rect_io)
+#define VFBIO_WRITE_RECTS	_IOW(VFB_IOCTL_MAGIC, 0xcd, struct vfb_rect_io)
+
+    /*
+     *  VFBIO_ACK_FLIP - tell the driver that the frame shown since the last
+     *  flip was picked up, for the latency statistics in debugfs
+     *  (vfb/fbN/latency). -EALREADY if it was acknowledged before.
+     */
+
+#define VFBIO_ACK_FLIP		_IO(VFB_IOCTL_MAGIC, 0xce)
+
+#endif /* _UAPI_VFB_H */